@@ -0,0 +1,412 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file main.cc
+/// @brief Benchmarks for Looper, Handler and HandlerThread, written to
+/// stdout as JSON so that results can be compared between releases.
+///
+/// Usage: nx_bench [--quick] [--repetitions=N] [--filter=SUBSTRING]
+///
+/// Every benchmark runs once to warm up and then the given number of times
+/// (5 by default), reporting the median, minimum and maximum of each metric.
+/// Inputs are generated from fixed seeds, so each run does the same work.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nx/application.h"
+#include "nx/handler.h"
+#include "nx/looper.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+// Metrics by name; each is reported with its unit in the name.
+typedef std::map<std::string, double> Metrics;
+
+double seconds(Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+double nanoseconds(Clock::duration duration) {
+  return std::chrono::duration<double, std::nano>(duration).count();
+}
+
+// Parses a whole decimal count, at least 1, or returns false.
+bool parseCount(const char* text, unsigned int* count) {
+  if (!std::isdigit(static_cast<unsigned char>(*text))) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  const unsigned long value = std::strtoul(text, &end, 10);
+  if (*end != '\0' || errno == ERANGE
+      || value > std::numeric_limits<unsigned int>::max()) {
+    return false;
+  }
+  *count = std::max(1u, static_cast<unsigned int>(value));
+  return true;
+}
+
+// Counts the messages it handles, so that producers can wait for them.
+class CountingHandler : public nx::Handler {
+  std::atomic<std::uint64_t> handled_;
+
+ public:
+  explicit CountingHandler(nx::Looper* looper)
+      : nx::Handler(looper)
+      , handled_(0) {
+  }
+  void handleMessage(nx::Message message) override {
+    handled_.store(handled_.load(std::memory_order_relaxed) + 1,
+        std::memory_order_release);
+  }
+  void waitFor(std::uint64_t count) const {
+    while (handled_.load(std::memory_order_acquire) < count) {
+      std::this_thread::yield();
+    }
+  }
+};
+
+// Records when it handles each message, for one message at a time.
+class StampingHandler : public nx::Handler {
+  std::atomic<Clock::rep> handledAt_;
+
+ public:
+  explicit StampingHandler(nx::Looper* looper)
+      : nx::Handler(looper)
+      , handledAt_(0) {
+  }
+  void handleMessage(nx::Message message) override {
+    handledAt_.store(Clock::now().time_since_epoch().count(),
+        std::memory_order_release);
+  }
+  // Waits for the message sent after the last call.
+  Clock::time_point wait() {
+    Clock::rep handledAt;
+    while ((handledAt = handledAt_.exchange(0, std::memory_order_acquire))
+        == 0) {
+      std::this_thread::yield();
+    }
+    return Clock::time_point(Clock::duration(handledAt));
+  }
+};
+
+class Benchmarks {
+  // Divides every workload, for quick runs that still cover each benchmark.
+  const unsigned int divisor_;
+
+  unsigned int scaled(unsigned int count) const {
+    return std::max(1u, count / divisor_);
+  }
+
+ public:
+  explicit Benchmarks(bool quick)
+      : divisor_(quick ? 20 : 1) {
+  }
+
+  // One thread sending to a HandlerThread as fast as it can.
+  Metrics singleProducer() const {
+    const unsigned int count = scaled(2000000);
+    nx::HandlerThread thread("consumer");
+    CountingHandler handler(thread.getLooper());
+    const Clock::time_point start = Clock::now();
+    for (unsigned int i = 0; i < count; ++i) {
+      handler.sendEmptyMessage(i);
+    }
+    handler.waitFor(count);
+    const Clock::duration elapsed = Clock::now() - start;
+    return {
+      {"messages", count},
+      {"messages_per_second", count / seconds(elapsed)},
+      {"ns_per_message", nanoseconds(elapsed) / count}
+    };
+  }
+
+  // Several threads sending to one HandlerThread at once.
+  Metrics multiProducer(unsigned int producers) const {
+    const unsigned int perProducer = scaled(500000);
+    nx::HandlerThread thread("consumer");
+    CountingHandler handler(thread.getLooper());
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (unsigned int p = 0; p < producers; ++p) {
+      threads.emplace_back([&handler, &go, perProducer]() {
+        while (!go.load(std::memory_order_acquire)) {
+          std::this_thread::yield();
+        }
+        for (unsigned int i = 0; i < perProducer; ++i) {
+          handler.sendEmptyMessage(i);
+        }
+      });
+    }
+    const Clock::time_point start = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& producer : threads) {
+      producer.join();
+    }
+    const std::uint64_t count =
+        static_cast<std::uint64_t>(perProducer) * producers;
+    handler.waitFor(count);
+    const Clock::duration elapsed = Clock::now() - start;
+    return {
+      {"producers", producers},
+      {"messages", static_cast<double>(count)},
+      {"messages_per_second", static_cast<double>(count) / seconds(elapsed)},
+      {"ns_per_message", nanoseconds(elapsed) / static_cast<double>(count)}
+    };
+  }
+
+  // How long a message sent to an idle HandlerThread takes to be handled.
+  Metrics sendToDispatchLatency(bool highResolution) const {
+    const unsigned int count = scaled(100000);
+    nx::LooperOptions options;
+    options.highResolution = highResolution;
+    nx::HandlerThread thread("consumer", options);
+    StampingHandler handler(thread.getLooper());
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    for (unsigned int i = 0; i < count; ++i) {
+      const Clock::time_point sent = Clock::now();
+      handler.sendEmptyMessage(i);
+      latencies.push_back(nanoseconds(handler.wait() - sent));
+    }
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](double q) {
+      const double rank = q * static_cast<double>(latencies.size());
+      return latencies[std::min(latencies.size() - 1,
+          static_cast<std::size_t>(rank))];
+    };
+    return {
+      {"messages", count},
+      {"p50_ns", percentile(0.5)},
+      {"p90_ns", percentile(0.9)},
+      {"p99_ns", percentile(0.99)},
+      {"p999_ns", percentile(0.999)},
+      {"max_ns", latencies.back()}
+    };
+  }
+
+  // Timeouts that are scheduled and nearly all cancelled before they fire,
+  // in rounds, with a backlog of outstanding delayed messages.
+  Metrics delayedChurn(bool timingWheel) const {
+    const unsigned int rounds = scaled(200);
+    const unsigned int perRound = 5000;
+    nx::LooperOptions options;
+    options.timingWheel = timingWheel;
+    nx::HandlerThread thread("consumer", options);
+    nx::Handler handler(thread.getLooper());
+    std::mt19937 random(12345);
+    std::uniform_int_distribution<int> delays(10, 30000);
+    std::uniform_int_distribution<unsigned int> ids(0, perRound * 4 - 1);
+    std::uint64_t sends = 0;
+    std::uint64_t removes = 0;
+    const Clock::time_point start = Clock::now();
+    for (unsigned int round = 0; round < rounds; ++round) {
+      for (unsigned int i = 0; i < perRound; ++i) {
+        handler.sendEmptyMessage(ids(random),
+            std::chrono::milliseconds(delays(random)));
+      }
+      for (unsigned int i = 0; i < perRound * 9 / 10; ++i) {
+        handler.removeMessages(ids(random));
+      }
+      sends += perRound;
+      removes += perRound * 9 / 10;
+    }
+    const Clock::duration elapsed = Clock::now() - start;
+    handler.removeCallbacksAndMessages();
+    const double operations = static_cast<double>(sends + removes);
+    return {
+      {"sends", static_cast<double>(sends)},
+      {"removes", static_cast<double>(removes)},
+      {"operations_per_second", operations / seconds(elapsed)},
+      {"ns_per_operation", nanoseconds(elapsed) / operations}
+    };
+  }
+
+  // hasMessages() while another thread keeps the looper busy.
+  Metrics hasMessagesUnderLoad() const {
+    const unsigned int queries = scaled(1000000);
+    nx::HandlerThread thread("consumer");
+    CountingHandler busy(thread.getLooper());
+    nx::Handler queried(thread.getLooper());
+    // a backlog for the queries to look through
+    for (unsigned int i = 0; i < 1000; ++i) {
+      queried.sendEmptyMessage(i, std::chrono::hours(1));
+    }
+    std::atomic<bool> stop(false);
+    std::uint64_t sent = 0;
+    std::thread producer([&busy, &stop, &sent]() {
+      while (!stop.load(std::memory_order_relaxed)) {
+        busy.sendEmptyMessage(0);
+        ++sent;
+      }
+    });
+    std::mt19937 random(12345);
+    std::uniform_int_distribution<unsigned int> ids(0, 1999);
+    unsigned int found = 0;
+    const Clock::time_point start = Clock::now();
+    for (unsigned int i = 0; i < queries; ++i) {
+      if (queried.hasMessages(ids(random))) {
+        ++found;
+      }
+    }
+    const Clock::duration elapsed = Clock::now() - start;
+    stop.store(true, std::memory_order_relaxed);
+    producer.join();
+    busy.waitFor(sent);
+    queried.removeCallbacksAndMessages();
+    return {
+      {"queries", queries},
+      {"hit_ratio", static_cast<double>(found) / queries},
+      {"ns_per_query", nanoseconds(elapsed) / queries},
+      {"concurrent_sends_per_second",
+          static_cast<double>(sent) / seconds(elapsed)}
+    };
+  }
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<Metrics()> run;
+};
+
+void writeJsonString(std::ostream& os, const std::string& value) {
+  os << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      os << '\\';
+    }
+    os << c;
+  }
+  os << '"';
+}
+
+}  // namespace
+
+/// @brief The class for the benchmark application.
+class BenchApplication : public nx::Application {
+ public:
+  int main() {
+    bool quick = false;
+    unsigned int repetitions = 5;
+    std::string filter;
+    const ArgumentVector& args = arguments();
+    for (std::size_t i = 1; i < args.size(); ++i) {
+      const std::string& arg = args[i];
+      if (arg == "--quick") {
+        quick = true;
+      } else if (arg.compare(0, 14, "--repetitions=") == 0
+          && parseCount(arg.c_str() + 14, &repetitions)) {
+        // parsed as part of the test, falling through to usage if malformed
+      } else if (arg.compare(0, 9, "--filter=") == 0) {
+        filter = arg.substr(9);
+      } else {
+        std::cerr << "usage: " << args[0]
+            << " [--quick] [--repetitions=N] [--filter=SUBSTRING]"
+            << std::endl;
+        return 1;
+      }
+    }
+
+    const Benchmarks benchmarks(quick);
+    const std::vector<Benchmark> all = {
+      {"single_producer_throughput",
+          [&]() { return benchmarks.singleProducer(); }},
+      {"multi_producer_throughput_2",
+          [&]() { return benchmarks.multiProducer(2); }},
+      {"multi_producer_throughput_4",
+          [&]() { return benchmarks.multiProducer(4); }},
+      {"send_to_dispatch_latency",
+          [&]() { return benchmarks.sendToDispatchLatency(false); }},
+      {"send_to_dispatch_latency_high_resolution",
+          [&]() { return benchmarks.sendToDispatchLatency(true); }},
+      {"delayed_churn_heap",
+          [&]() { return benchmarks.delayedChurn(false); }},
+      {"delayed_churn_timing_wheel",
+          [&]() { return benchmarks.delayedChurn(true); }},
+      {"has_messages_under_load",
+          [&]() { return benchmarks.hasMessagesUnderLoad(); }}
+    };
+
+    std::ostream& os = std::cout;
+    os << "{\n  \"context\": {\"quick\": " << (quick ? "true" : "false")
+        << ", \"repetitions\": " << repetitions
+        << ", \"hardware_concurrency\": "
+        << std::thread::hardware_concurrency()
+#ifdef NDEBUG
+        << ", \"optimized\": true"
+#else
+        << ", \"optimized\": false"
+#endif
+        << "},\n  \"benchmarks\": [";
+    bool first = true;
+    for (const Benchmark& benchmark : all) {
+      if (benchmark.name.find(filter) == std::string::npos) {
+        continue;
+      }
+      std::cerr << benchmark.name << "..." << std::endl;
+      benchmark.run();  // warm up
+      std::map<std::string, std::vector<double>> samples;
+      for (unsigned int i = 0; i < repetitions; ++i) {
+        for (const auto& metric : benchmark.run()) {
+          samples[metric.first].push_back(metric.second);
+        }
+      }
+      os << (first ? "\n" : ",\n") << "    {\"name\": ";
+      first = false;
+      writeJsonString(os, benchmark.name);
+      os << ", \"metrics\": {";
+      bool firstMetric = true;
+      for (auto& metric : samples) {
+        std::vector<double>& values = metric.second;
+        std::sort(values.begin(), values.end());
+        os << (firstMetric ? "\n" : ",\n") << "      ";
+        firstMetric = false;
+        writeJsonString(os, metric.first);
+        std::ostringstream summary;
+        summary.precision(6);
+        summary << "{\"median\": " << values[values.size() / 2]
+            << ", \"min\": " << values.front()
+            << ", \"max\": " << values.back() << "}";
+        os << ": " << summary.str();
+      }
+      os << "\n    }}";
+    }
+    os << "\n  ]\n}" << std::endl;
+    return 0;
+  }
+};
+
+/// @brief Function to lazy-load the application; required by nx_main.cc
+nx::Application& nx::GetApplication() {
+  static BenchApplication app;
+  return app;
+}
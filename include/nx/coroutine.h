@@ -0,0 +1,381 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file coroutine.h
+/// @brief Coroutines that hop between loopers.  Only available when built as
+/// C++20 or later, in which case NX_HAS_COROUTINES is defined.
+
+#ifndef INCLUDE_NX_COROUTINE_H_
+#define INCLUDE_NX_COROUTINE_H_
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define NX_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef NX_HAS_COROUTINES
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "nx/handler.h"
+#include "nx/looper.h"
+#include "nx/message_payload.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+template <typename T = void>
+class Task;
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Coroutine {
+
+class PromiseBase {
+  std::coroutine_handle<> continuation_;
+  // The promise of the coroutine awaiting this one, if it is a Task.
+  PromiseBase* parent_;
+  std::exception_ptr exception_;
+  // The coroutine's own handle once detached, after which it owns itself.
+  std::coroutine_handle<> detached_;
+
+  template <typename T>
+  friend class nx::Task;
+
+ public:
+  struct FinalAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> handle) noexcept {
+      PromiseBase& promise = handle.promise();
+      if (promise.detached_) {
+        handle.destroy();
+        return std::noop_coroutine();
+      }
+      if (promise.continuation_) {
+        return promise.continuation_;
+      }
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {
+    }
+  };
+
+  PromiseBase()
+      : parent_(nullptr) {
+  }
+
+  // Frames share the pool that holds large message payloads.
+  static void* operator new(std::size_t size) {
+    return Payload::allocate(size);
+  }
+  static void operator delete(void* frame, std::size_t size) {
+    Payload::deallocate(frame, size);
+  }
+
+  std::suspend_always initial_suspend() noexcept {
+    return {};
+  }
+  FinalAwaiter final_suspend() noexcept {
+    return {};
+  }
+  void unhandled_exception() {
+    if (detached_) {
+      // there's nobody to rethrow it to, as with std::thread
+      std::terminate();
+    }
+    exception_ = std::current_exception();
+  }
+  void rethrow() const {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+  /// @brief For when the message that was to resume this coroutine is
+  /// destroyed without running: if the Task it belongs to, or one awaiting
+  /// it, was detached, nothing else owns the frames, so they are destroyed.
+  void strand() {
+    PromiseBase* root = this;
+    while (root->parent_) {
+      root = root->parent_;
+    }
+    if (root->detached_) {
+      // each frame's Tasks destroy the ones it was awaiting
+      root->detached_.destroy();
+    }
+  }
+};
+
+template <typename Promise>
+PromiseBase* promiseOf(std::coroutine_handle<Promise> handle) {
+  if constexpr (std::is_base_of<PromiseBase, Promise>::value) {
+    return &handle.promise();
+  } else {
+    return nullptr;
+  }
+}
+
+/// @brief Resumes a coroutine when posted to a looper; small enough to be
+/// stored inline in the message.  Destroyed without having run, as when the
+/// message is removed or the looper quits, it strands the coroutine.
+class Resume {
+  std::coroutine_handle<> handle_;
+  PromiseBase* promise_;
+
+ public:
+  Resume(std::coroutine_handle<> handle, PromiseBase* promise)
+      : handle_(handle)
+      , promise_(promise) {
+  }
+  Resume(Resume&& other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr))
+      , promise_(std::exchange(other.promise_, nullptr)) {
+  }
+  Resume& operator=(Resume&&) = delete;
+  ~Resume() {
+    if (handle_ && promise_) {
+      promise_->strand();
+    }
+  }
+
+  void operator()() {
+    std::exchange(handle_, nullptr).resume();
+  }
+  /// @brief Gives up the coroutine without resuming it, for when the message
+  /// wasn't sent after all and the awaiter carries on.
+  void release() {
+    handle_ = nullptr;
+  }
+};
+
+template <typename T>
+class Promise : public PromiseBase {
+  std::optional<T> value_;
+
+ public:
+  Task<T> get_return_object();
+  template <typename U>
+  void return_value(U&& value) {
+    value_.emplace(std::forward<U>(value));
+  }
+  T take() {
+    rethrow();
+    return std::move(*value_);
+  }
+};
+
+template <>
+class Promise<void> : public PromiseBase {
+ public:
+  Task<void> get_return_object();
+  void return_void() {
+  }
+  void take() {
+    rethrow();
+  }
+};
+
+}  // namespace Coroutine
+
+}  // namespace detail
+/// @endcond
+
+/// @brief A coroutine that produces a T.  It starts suspended, and runs once
+/// it is either awaited by another coroutine or detached.
+template <typename T>
+class Task {
+ public:
+  typedef detail::Coroutine::Promise<T> promise_type;
+
+ private:
+  std::coroutine_handle<promise_type> handle_;
+
+ public:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {
+  }
+  Task(Task&& other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)) {
+  }
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  /// @brief Runs the coroutine on the calling thread until it first
+  /// suspends, after which it destroys itself once it completes.  An
+  /// exception that escapes it terminates the program.
+  void detach() {
+    std::coroutine_handle<promise_type> handle =
+        std::exchange(handle_, nullptr);
+    handle.promise().detached_ = handle;
+    handle.resume();
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> awaiting) noexcept {
+    handle_.promise().continuation_ = awaiting;
+    handle_.promise().parent_ = detail::Coroutine::promiseOf(awaiting);
+    return handle_;
+  }
+  T await_resume() {
+    return handle_.promise().take();
+  }
+};
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Coroutine {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(
+      std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+}  // namespace Coroutine
+
+}  // namespace detail
+/// @endcond
+
+/// @brief Awaiting this continues the coroutine on the looper's thread, by
+/// way of a single message; if already there, it continues without one.
+/// Throws std::runtime_error if the looper has quit.
+class ResumeOn {
+  Looper* looper_;
+  bool posted_;
+
+ public:
+  explicit ResumeOn(Looper* looper)
+      : looper_(looper)
+      , posted_(true) {
+  }
+  bool await_ready() const {
+    return looper_->getThreadId() == std::this_thread::get_id();
+  }
+  template <typename Promise>
+  bool await_suspend(std::coroutine_handle<Promise> handle) {
+    MessagePayload payload;
+    payload.emplaceCallback<detail::Coroutine::Resume>(handle,
+        detail::Coroutine::promiseOf(handle));
+    // Once posted, the coroutine may already be running on the other thread
+    // and this awaiter must not be touched.
+    if (looper_->postCallback(&payload)) {
+      return true;
+    }
+    // the payload is still ours, and the coroutine carries on
+    payload.getCallback<detail::Coroutine::Resume>()->release();
+    posted_ = false;
+    return false;
+  }
+  void await_resume() const {
+    if (!posted_) {
+      throw std::runtime_error("Cannot resume on a looper that has quit.");
+    }
+  }
+};
+
+inline ResumeOn resumeOn(Looper* looper) {
+  return ResumeOn(looper);
+}
+
+/// @brief Awaiting this continues the coroutine on the handler's looper once
+/// the time comes, as a delayed message to the handler.  Removing the
+/// handler's messages, or destroying the handler, strands the coroutine: if
+/// it was detached, it is destroyed without resuming.  Throws
+/// std::runtime_error if the looper has quit.
+class SleepUntil {
+  Handler* handler_;
+  Handler::SteadyTimePoint triggerTime_;
+  bool posted_;
+
+ public:
+  SleepUntil(Handler* handler, Handler::SteadyTimePoint triggerTime)
+      : handler_(handler)
+      , triggerTime_(triggerTime)
+      , posted_(true) {
+  }
+  bool await_ready() const noexcept {
+    return false;
+  }
+  template <typename Promise>
+  bool await_suspend(std::coroutine_handle<Promise> handle) {
+    MessagePayload payload;
+    payload.emplaceCallback<detail::Coroutine::Resume>(handle,
+        detail::Coroutine::promiseOf(handle));
+    if (handler_->postCallback(&payload, triggerTime_) != 0) {
+      return true;
+    }
+    payload.getCallback<detail::Coroutine::Resume>()->release();
+    posted_ = false;
+    return false;
+  }
+  void await_resume() const {
+    if (!posted_) {
+      throw std::runtime_error("Cannot sleep on a looper that has quit.");
+    }
+  }
+};
+
+inline SleepUntil sleepUntil(Handler* handler,
+    Handler::SteadyTimePoint triggerTime) {
+  return SleepUntil(handler, triggerTime);
+}
+template <typename Rep, typename Period>
+SleepUntil sleepFor(Handler* handler,
+    std::chrono::duration<Rep, Period> delay) {
+  return SleepUntil(handler, std::chrono::steady_clock::now()
+      + std::chrono::ceil<std::chrono::steady_clock::duration>(delay));
+}
+
+}  // namespace nx
+
+#endif  // NX_HAS_COROUTINES
+
+#endif  // INCLUDE_NX_COROUTINE_H_
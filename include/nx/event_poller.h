@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file event_poller.h
+/// @brief The epoll based sleep/wake mechanism used by Looper on linux.
+/// Using this directly is not supported; create a HandlerThread.
+
+#ifndef INCLUDE_NX_EVENT_POLLER_H_
+#define INCLUDE_NX_EVENT_POLLER_H_
+
+#include <utility>
+#include <vector>
+
+#include "nx/message_queue.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Looper {
+
+/// @brief Waits on an epoll instance that watches an eventfd, used to wake
+/// it, a timerfd, used for deadlines with nanosecond resolution, and any
+/// number of other descriptors.  Event masks use the Looper::kEvent* values.
+class EventPoller {
+  int epollFd_;
+  int wakeFd_;
+  int timerFd_;
+  // The deadline timerFd_ is currently armed for, to skip redundant syscalls.
+  SteadyTimePoint armed_;
+
+  void arm(SteadyTimePoint deadline);
+  void closeDescriptors();
+
+ public:
+  typedef std::vector<std::pair<int, unsigned int>> ReadyList;
+
+  /// @brief Returns whether this platform supports EventPoller.
+  static bool supported();
+
+  /// @throws std::system_error if any of the descriptors can't be created.
+  EventPoller();
+  ~EventPoller();
+  EventPoller(const EventPoller&) = delete;
+  EventPoller& operator=(const EventPoller&) = delete;
+
+  /// @brief Makes a current or the next wait() return.  Safe to call from
+  /// any thread.
+  void wake();
+  /// @brief Starts watching fd, or changes the events watched for.
+  bool add(int fd, unsigned int events);
+  bool remove(int fd);
+  /// @brief Waits until the deadline, a wake() or readiness of a watched
+  /// descriptor, appending any ready descriptors and their events to ready.
+  /// A deadline that has already passed polls without blocking.
+  void wait(SteadyTimePoint deadline, ReadyList* ready);
+};
+
+}  // namespace Looper
+
+}  // namespace detail
+/// @endcond
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_EVENT_POLLER_H_
@@ -0,0 +1,263 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file future.h
+/// @brief The result of Handler::call(), kept in the message that made it.
+
+#ifndef INCLUDE_NX_FUTURE_H_
+#define INCLUDE_NX_FUTURE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "nx/looper.h"
+#include "nx/message_payload.h"
+#include "nx/message_queue.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Looper {
+
+/// @brief What the queue and a Future share of a call, apart from its
+/// result.  It lives within the message's payload, which is only recycled
+/// once both are done with the node.
+class CallStateBase {
+ public:
+  enum Status : unsigned int {
+    kPending,
+    kReady,
+    // Removed or dropped before it ran.
+    kAbandoned
+  };
+
+ private:
+  std::atomic<unsigned int> status_;
+  std::mutex mutex_;
+  std::condition_variable conditionVariable_;
+  // Set by Future::then(); posted to continuationLooper_ once settled.
+  nx::Looper* continuationLooper_;
+  MessagePayload continuation_;
+
+ protected:
+  /// @brief Sets the status, waking any waiter and posting any continuation.
+  void settle(Status status);
+
+ public:
+  CallStateBase();
+  CallStateBase(const CallStateBase&) = delete;
+  CallStateBase& operator=(const CallStateBase&) = delete;
+
+  Status status() const;
+  void wait();
+  /// @brief Settles the call as abandoned if it has yet to run.  Called as
+  /// the node is retired, without the looper's lock, since the continuation
+  /// may be posted to the same looper.
+  void abandon();
+  /// @brief Posts the continuation to the looper once settled, or right
+  /// away if already settled.
+  /// @return False if the looper has quit.
+  bool setContinuation(nx::Looper* looper, MessagePayload* continuation);
+};
+
+template <typename R>
+class CallState : public CallStateBase {
+  std::optional<R> value_;
+  std::exception_ptr exception_;
+
+ protected:
+  template <typename F>
+  void run(F* function) {
+    try {
+      value_.emplace((*function)());
+    } catch (...) {
+      exception_ = std::current_exception();
+    }
+    settle(kReady);
+  }
+
+ public:
+  R take() {
+    if (status() == kAbandoned) {
+      throw std::future_error(std::future_errc::broken_promise);
+    }
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+    return std::move(*value_);
+  }
+};
+
+template <>
+class CallState<void> : public CallStateBase {
+  std::exception_ptr exception_;
+
+ protected:
+  template <typename F>
+  void run(F* function) {
+    try {
+      (*function)();
+    } catch (...) {
+      exception_ = std::current_exception();
+    }
+    settle(kReady);
+  }
+
+ public:
+  void take() {
+    if (status() == kAbandoned) {
+      throw std::future_error(std::future_errc::broken_promise);
+    }
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+};
+
+/// @brief The callback of a Handler::call() message.
+template <typename F, typename R>
+class Call : public CallState<R> {
+  F function_;
+
+ public:
+  template <typename G>
+  explicit Call(G&& function)
+      : function_(std::forward<G>(function)) {
+  }
+  Call(Call&&) = delete;
+  void operator()() {
+    this->run(&function_);
+  }
+};
+
+}  // namespace Looper
+
+}  // namespace detail
+/// @endcond
+
+/// @brief The eventual result of a Handler::call().  Its state lives in the
+/// node that carried the call, so no separate shared state is allocated.
+/// Move-only; not safe to use from more than one thread at a time.
+template <typename R>
+class Future {
+  typedef detail::Looper::Node Node;
+  typedef detail::Looper::CallState<R> State;
+
+  Node* node_;
+  State* state_;
+
+  void reset() {
+    if (node_) {
+      detail::Looper::NodePool::unshare(node_);
+      node_ = nullptr;
+      state_ = nullptr;
+    }
+  }
+  void checkValid() const {
+    if (!valid()) {
+      throw std::future_error(std::future_errc::no_state);
+    }
+  }
+
+ public:
+  Future()
+      : node_(nullptr)
+      , state_(nullptr) {
+  }
+  /// @cond nx_detail
+  Future(Node* node, State* state)
+      : node_(node)
+      , state_(state) {
+  }
+  /// @endcond
+  Future(Future&& other) noexcept
+      : node_(std::exchange(other.node_, nullptr))
+      , state_(std::exchange(other.state_, nullptr)) {
+  }
+  Future& operator=(Future&& other) noexcept {
+    if (this != &other) {
+      reset();
+      node_ = std::exchange(other.node_, nullptr);
+      state_ = std::exchange(other.state_, nullptr);
+    }
+    return *this;
+  }
+  Future(const Future&) = delete;
+  Future& operator=(const Future&) = delete;
+  ~Future() {
+    reset();
+  }
+
+  /// @brief False once get() has been called, or if the call was never sent.
+  bool valid() const {
+    return node_ != nullptr;
+  }
+  /// @brief Whether get() would return without blocking; false if not
+  /// valid().
+  bool ready() const {
+    return valid() && state_->status() != State::kPending;
+  }
+  /// @brief Throws std::future_error with no_state if not valid().
+  void wait() const {
+    checkValid();
+    state_->wait();
+  }
+  /// @brief Blocks until the call has run, then returns its result or
+  /// rethrows what it threw.  Throws std::future_error with broken_promise if
+  /// it was removed or its looper quit before it ran, or with no_state if not
+  /// valid().
+  R get() {
+    wait();
+    Future keep(std::move(*this));
+    return keep.state_->take();
+  }
+  /// @brief Invokes continuation with this future, once ready, on looper's
+  /// thread.
+  /// Throws std::future_error with no_state if not valid().
+  /// @return False if looper has quit, in which case the continuation is
+  /// destroyed without being run.
+  template <typename G>
+  bool then(nx::Looper* looper, G&& continuation) {
+    checkValid();
+    State* state = state_;
+    MessagePayload payload;
+    payload.emplaceCallback(
+        [future = std::move(*this),
+            continuation = std::forward<G>(continuation)]() mutable {
+          continuation(std::move(future));
+        });
+    return state->setContinuation(looper, &payload);
+  }
+  /// @brief As above, on the calling thread's looper.
+  template <typename G>
+  bool then(G&& continuation) {
+    return then(nx::Looper::threadLooper().get(),
+        std::forward<G>(continuation));
+  }
+};
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_FUTURE_H_
@@ -20,15 +20,23 @@
 #ifndef INCLUDE_NX_HANDLER_H_
 #define INCLUDE_NX_HANDLER_H_
 
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <iterator>
 #include <string>
 #include <memory>
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
+#include <utility>
 
+#include "nx/future.h"
+#include "nx/looper.h"
 #include "nx/message.h"
+#include "nx/native_thread.h"
 #include "nx/thread_compat.h"
 
 /// @brief Library namespace.
@@ -49,12 +57,42 @@ class Handler {
   Looper* const looper_;
   Callback* const callback_;
 
+ private:
+  // Lets the destructor purge pending messages only if the looper is alive.
+  const std::weak_ptr<Looper> looperReference_;
+  std::atomic<unsigned int> nextCallbackToken_;
+
+  typedef std::chrono::steady_clock::duration ClockDuration;
+
+  template <typename Rep, typename Period>
+  static ClockDuration toClockDuration(
+      std::chrono::duration<Rep, Period> delay) {
+    return std::chrono::ceil<ClockDuration>(delay);
+  }
+  bool sendDelayed(Message message, ClockDuration delay,
+      MessagePayload* payload = nullptr);
+
  public:
   typedef std::chrono::time_point<std::chrono::steady_clock> SteadyTimePoint;
+
+ private:
+  /// @brief Sends the callback held by payload as a message.
+  /// @return Its token, or 0 if it wasn't sent.
+  unsigned int postCallback(MessagePayload* payload, ClockDuration delay);
+  unsigned int postCallback(MessagePayload* payload,
+      SteadyTimePoint triggerTime);
+  Message callbackMessage();
+  /// @brief Sends the call held by payload in node, which is shared with a
+  /// Future.
+  bool sendCall(MessagePayload* payload, detail::Looper::Node* node);
+
+ public:
   Handler();
   explicit Handler(Callback* callback);
   explicit Handler(Looper* looper);
   Handler(Looper* looper, Callback* callback);
+  /// @brief Removes any messages still pending for this handler.
+  virtual ~Handler();
 
   void dispatchMessage(Message message);
 
@@ -65,36 +103,248 @@ class Handler {
   bool hasMessages(unsigned int id, void* data) const;
 
   bool sendMessageAtFrontOfQueue(Message message);
-  bool sendMessage(Message msg,
-      std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+  bool sendMessage(Message msg);
+  /// @brief Sends the message after the delay, which may be any duration.
+  /// Delays finer than the steady clock are rounded up, so a message is never
+  /// dispatched early.
+  template <typename Rep, typename Period>
+  bool sendMessage(Message msg, std::chrono::duration<Rep, Period> delay) {
+    return sendDelayed(msg, toClockDuration(delay));
+  }
   bool sendMessage(Message msg, SteadyTimePoint triggerTime);
+  /// @brief Sends the message along with the payload, which is moved into
+  /// the queue and may be read with Message::payload() while it is handled.
+  /// It is destroyed once the message has been handled, or when the message
+  /// is removed or dropped.
+  bool sendMessage(Message msg, MessagePayload payload);
+  template <typename Rep, typename Period>
+  bool sendMessage(Message msg, MessagePayload payload,
+      std::chrono::duration<Rep, Period> delay) {
+    return sendDelayed(msg, toClockDuration(delay), &payload);
+  }
+  bool sendMessage(Message msg, MessagePayload payload,
+      SteadyTimePoint triggerTime);
+  bool sendEmptyMessage(unsigned int id);
+  template <typename Rep, typename Period>
   bool sendEmptyMessage(unsigned int id,
-      std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+      std::chrono::duration<Rep, Period> delay) {
+    return sendDelayed(Message(id), toClockDuration(delay));
+  }
   bool sendEmptyMessage(unsigned int id, SteadyTimePoint triggerTime);
 
+  /// @brief Sends the message unless one with its id is already pending for
+  /// this handler, checking and sending atomically under a single lock
+  /// acquisition.  Use this in place of hasMessages() followed by a send,
+  /// which races with other senders.
+  /// @return False if one was pending, or the looper has quit.
+  bool sendMessageIfAbsent(Message msg);
+  template <typename Rep, typename Period>
+  bool sendMessageIfAbsent(Message msg,
+      std::chrono::duration<Rep, Period> delay) {
+    return sendMessageIfAbsent(msg,
+        std::chrono::steady_clock::now() + toClockDuration(delay));
+  }
+  bool sendMessageIfAbsent(Message msg, SteadyTimePoint triggerTime);
+  /// @brief As above, with a payload, which is only taken if sent.
+  bool sendMessageIfAbsent(Message msg, MessagePayload payload,
+      SteadyTimePoint triggerTime);
+
+  /// @brief Sends the message every period, first a period from now, until
+  /// removed by removeMessages().  The message keeps its place in the queue
+  /// between firings, so each costs no more than a delayed send, and with
+  /// kFixedRate each deadline follows from the last rather than from when
+  /// it was dispatched, so latency doesn't make it drift.  A payload is
+  /// kept for every firing, and destroyed once the message is removed.
+  /// @param missedTicks For kFixedRate, what to do about ticks missed by
+  /// running late.
+  /// @return False if the period isn't positive or the looper has quit.
+  template <typename Rep, typename Period>
+  bool sendPeriodic(Message msg, std::chrono::duration<Rep, Period> period,
+      PeriodicPolicy policy = PeriodicPolicy::kFixedRate,
+      MissedTicks missedTicks = MissedTicks::kSkip) {
+    const ClockDuration clockPeriod = toClockDuration(period);
+    return sendPeriodic(msg, std::chrono::steady_clock::now() + clockPeriod,
+        clockPeriod, policy, missedTicks);
+  }
+  /// @brief As above, first firing at the given time.
+  bool sendPeriodic(Message msg, SteadyTimePoint first, ClockDuration period,
+      PeriodicPolicy policy = PeriodicPolicy::kFixedRate,
+      MissedTicks missedTicks = MissedTicks::kSkip);
+  bool sendPeriodic(Message msg, MessagePayload payload,
+      SteadyTimePoint first, ClockDuration period,
+      PeriodicPolicy policy = PeriodicPolicy::kFixedRate,
+      MissedTicks missedTicks = MissedTicks::kSkip);
+
+  /// @brief Replaces the pending messages with the message's id for this
+  /// handler with this one, or sends it if there are none, atomically.
+  /// Replacing a message swaps in the new one and its payload, if any; any
+  /// further messages with that id are removed.
+  /// @param deadline Whether the replacement keeps the pending message's
+  /// trigger time when that is earlier, or is pushed back to its own.
+  template <typename Rep, typename Period>
+  bool replaceMessage(Message msg, std::chrono::duration<Rep, Period> delay,
+      ReplaceDeadline deadline = ReplaceDeadline::kKeepEarlier) {
+    return replaceMessage(msg,
+        std::chrono::steady_clock::now() + toClockDuration(delay), deadline);
+  }
+  bool replaceMessage(Message msg, SteadyTimePoint triggerTime,
+      ReplaceDeadline deadline = ReplaceDeadline::kKeepEarlier);
+  template <typename Rep, typename Period>
+  bool replaceMessage(Message msg, MessagePayload payload,
+      std::chrono::duration<Rep, Period> delay,
+      ReplaceDeadline deadline = ReplaceDeadline::kKeepEarlier) {
+    return replaceMessage(msg, std::move(payload),
+        std::chrono::steady_clock::now() + toClockDuration(delay), deadline);
+  }
+  bool replaceMessage(Message msg, MessagePayload payload,
+      SteadyTimePoint triggerTime,
+      ReplaceDeadline deadline = ReplaceDeadline::kKeepEarlier);
+
+  /// @brief Sends every message in [first, last), in order, taking the
+  /// looper's lock once and waking it at most once.  Not all-or-nothing:
+  /// if the looper has a capacity and one can't be queued, the ones before
+  /// it stay queued and the rest are not sent.
+  /// @return How many were sent, counted from first; 0 if the looper has
+  /// quit.
+  template <typename Iterator>
+  std::size_t sendMessages(Iterator first,
+      Iterator last, SteadyTimePoint triggerTime);
+  template <typename Iterator>
+  std::size_t sendMessages(Iterator first, Iterator last) {
+    return sendMessages(first, last, std::chrono::steady_clock::now());
+  }
+  template <typename Iterator, typename Rep, typename Period>
+  std::size_t sendMessages(Iterator first, Iterator last,
+      std::chrono::duration<Rep, Period> delay) {
+    return sendMessages(first, last,
+        std::chrono::steady_clock::now() + toClockDuration(delay));
+  }
+  /// @brief Sends every message in the range, as with the iterator overloads.
+  template <typename Range>
+  std::size_t sendMessages(const Range& messages,
+      SteadyTimePoint triggerTime) {
+    return sendMessages(std::begin(messages), std::end(messages), triggerTime);
+  }
+  template <typename Range>
+  std::size_t sendMessages(const Range& messages) {
+    return sendMessages(std::begin(messages), std::end(messages));
+  }
+  template <typename Range, typename Rep, typename Period>
+  std::size_t sendMessages(const Range& messages,
+      std::chrono::duration<Rep, Period> delay) {
+    return sendMessages(std::begin(messages), std::end(messages), delay);
+  }
+
+  /// @brief Runs callback, which takes no arguments, on the looper's thread
+  /// in order with the messages sent to this handler.  Callables of up to
+  /// MessagePayload::kInlineSize bytes are stored within the queue, so
+  /// posting them does not allocate.  A callback that never runs is
+  /// destroyed by whoever removes it, or by the looper's thread as it quits,
+  /// never with the looper locked, so its captures may use the looper.
+  /// @return A token for removeCallbacks(), or 0 if the looper has quit.
+  template <typename F>
+  unsigned int post(F&& callback) {
+    MessagePayload payload;
+    payload.emplaceCallback(std::forward<F>(callback));
+    return postCallback(&payload, ClockDuration::zero());
+  }
+  template <typename F, typename Rep, typename Period>
+  unsigned int postDelayed(F&& callback,
+      std::chrono::duration<Rep, Period> delay) {
+    MessagePayload payload;
+    payload.emplaceCallback(std::forward<F>(callback));
+    return postCallback(&payload, toClockDuration(delay));
+  }
+  template <typename F>
+  unsigned int postAtTime(F&& callback, SteadyTimePoint triggerTime) {
+    MessagePayload payload;
+    payload.emplaceCallback(std::forward<F>(callback));
+    return postCallback(&payload, triggerTime);
+  }
+  /// @brief Runs function, which takes no arguments, on the looper's thread
+  /// as with post(), making its result available through the returned
+  /// future.  The future's state is kept in the message itself, so this
+  /// allocates nothing once the looper's caches are warm.  The message can
+  /// be removed by removeCallbacksAndMessages().
+  /// @return The future, which is not valid() if the looper has quit.
+  template <typename F,
+      typename R = std::invoke_result_t<std::decay_t<F>&>>
+  Future<R> call(F&& function) {
+    typedef detail::Looper::Call<std::decay_t<F>, R> CallType;
+    // A call can't be moved, so it is never stored inline and its address
+    // survives the payload moving into the node.
+    static_assert(!std::is_move_constructible<CallType>::value,
+        "calls must stay where they are constructed");
+    MessagePayload payload;
+    CallType& call = payload.emplaceCallback<CallType>(
+        std::forward<F>(function));
+    detail::Looper::Node* node = detail::Looper::NodePool::obtain();
+    node->callState_ = &call;
+    node->references_.store(2, std::memory_order_relaxed);
+    if (!sendCall(&payload, node)) {
+      node->references_.store(1, std::memory_order_relaxed);
+      detail::Looper::NodePool::unshare(node);
+      return Future<R>();
+    }
+    return Future<R>(node, &call);
+  }
+
+  /// @brief Cancels a posted callback that has yet to run, destroying it on
+  /// this thread once the looper's lock is released.
+  /// @return False if it already ran or was removed.
+  bool removeCallbacks(unsigned int token);
+  bool hasCallbacks(unsigned int token) const;
+
   void removeMessages(unsigned int id);
   void removeMessages(unsigned int id, void* data);
+  /// @brief Removes every pending message for this handler, in time
+  /// proportional to their number.
+  void removeCallbacksAndMessages();
 
   //
   virtual void handleMessage(Message message);
+
+  friend class SleepUntil;
 };
 
 class HandlerThread {
   std::string name_;
-  std::unique_ptr<std::thread> threadObject_;
+  const LooperOptions options_;
+  const ThreadOptions threadOptions_;
+  std::unique_ptr<detail::NativeThread> threadObject_;
   std::shared_ptr<Looper> looper_;
   std::mutex mutex_;
   std::condition_variable conditionVariable_;
+  // Set by the thread once it has applied threadOptions_ and prepared its
+  // looper.
+  bool started_;
+  std::error_code startError_;
 
   void threadFunction();
 
  public:
-  explicit HandlerThread(const std::string& name);
+  /// @brief Starts the thread.  Throws std::system_error if it can't be
+  /// started, threadOptions can't be applied to it or options are out of
+  /// range; in particular, real-time scheduling usually requires privileges.
+  explicit HandlerThread(const std::string& name,
+      const LooperOptions& options = LooperOptions(),
+      const ThreadOptions& threadOptions = ThreadOptions());
   ~HandlerThread();
   /// @brief Blocks until the looper is available.
   Looper* getLooper();
+  const std::string& getName() const;
+  /// @brief The settings the OS reports for the thread, which may differ from
+  /// those requested: the name is truncated and the stack size rounded up.
+  ThreadSettings threadSettings() const;
   void join();
 };
+
+template <typename Iterator>
+std::size_t Handler::sendMessages(Iterator first, Iterator last,
+    SteadyTimePoint triggerTime) {
+  return looper_->send(this, first, last, triggerTime);
+}
+
 }  // namespace nx
 
 #endif  // INCLUDE_NX_HANDLER_H_
@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file handler_thread_pool.h
+/// @brief A pool of threads that share the messages of handlers that are not
+/// bound to any one thread.
+
+#ifndef INCLUDE_NX_HANDLER_THREAD_POOL_H_
+#define INCLUDE_NX_HANDLER_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nx/message.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+class HandlerThreadPool;
+
+/// @brief A handler whose messages run on whichever thread of its pool is
+/// free.  It must outlive every message sent to it; for an ordered handler,
+/// destruction waits for any that are still queued to run.
+class PoolHandler {
+ public:
+  enum class Ordering {
+    /// @brief Messages may run concurrently and in any order.
+    kUnordered,
+    /// @brief Messages sent with the same key run one at a time, in the order
+    /// they were sent.  Keys share one of a fixed number of stripes, so with
+    /// a single stripe every message is serialized.
+    kOrderedPerKey
+  };
+
+  /// @cond nx_detail
+  /// @brief A serialized mailbox; only one thread drains it at a time.
+  struct Strand {
+    std::mutex mutex;
+    std::deque<Message> messages;
+    bool scheduled;
+    Strand();
+  };
+  /// @endcond
+
+ private:
+  HandlerThreadPool* const pool_;
+  const Ordering ordering_;
+  std::unique_ptr<Strand[]> strands_;
+  const std::size_t stripes_;
+
+  friend class HandlerThreadPool;
+
+ public:
+  explicit PoolHandler(HandlerThreadPool* pool,
+      Ordering ordering = Ordering::kUnordered, std::size_t stripes = 64);
+  virtual ~PoolHandler();
+  PoolHandler(const PoolHandler&) = delete;
+  PoolHandler& operator=(const PoolHandler&) = delete;
+
+  HandlerThreadPool* pool();
+
+  /// @brief Sends the message to run as soon as a thread is free; for an
+  /// ordered handler, this uses key 0.  Safe to call from any thread.
+  bool sendMessage(Message message);
+  /// @brief For an ordered handler, runs the message after every message
+  /// previously sent with the same key.  Safe to call from any thread.
+  bool sendMessage(Message message, std::size_t key);
+
+  virtual void handleMessage(Message message);
+};
+
+/// @brief A fixed number of threads, each with its own deque of runnable
+/// messages.  Messages sent from a pool thread go to its own deque and
+/// others round-robin between them; a thread that runs out takes half of
+/// another's.  Only immediate messages are supported.
+class HandlerThreadPool {
+  struct Task {
+    PoolHandler* handler;
+    Message message;
+    // Set if the task is to drain the strand rather than run message.
+    PoolHandler::Strand* strand;
+  };
+  struct alignas(64) Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    // Mirrors tasks.size(), so that it can be checked without the lock.
+    std::atomic<std::size_t> size;
+    std::vector<Task> stolen;
+    Worker();
+  };
+
+  const std::string name_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic_bool isQuitting_;
+  std::atomic<std::size_t> nextWorker_;
+  std::atomic<std::size_t> sleepers_;
+  std::atomic<std::uint64_t> steals_;
+  std::mutex sleepMutex_;
+  std::condition_variable conditionVariable_;
+
+  void threadFunction(std::size_t index);
+  bool take(std::size_t index, Task* task);
+  bool steal(std::size_t index, Task* task);
+  bool anyQueued() const;
+  void run(const Task& task);
+  void runStrand(PoolHandler* handler, PoolHandler::Strand* strand);
+  bool submit(const Task& task);
+
+  friend class PoolHandler;
+
+ public:
+  /// @param threads The number of threads; 0 uses one per hardware thread.
+  explicit HandlerThreadPool(const std::string& name,
+      std::size_t threads = 0);
+  /// @brief Stops the threads; messages that have yet to run are dropped.
+  ~HandlerThreadPool();
+  HandlerThreadPool(const HandlerThreadPool&) = delete;
+  HandlerThreadPool& operator=(const HandlerThreadPool&) = delete;
+
+  std::size_t size() const;
+  /// @brief How many times a thread has taken messages from another.
+  std::uint64_t steals() const;
+};
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_HANDLER_THREAD_POOL_H_
@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file io_ring.h
+/// @brief Asynchronous file I/O through io_uring, with completions delivered
+/// to a Handler as messages.
+
+#ifndef INCLUDE_NX_IO_RING_H_
+#define INCLUDE_NX_IO_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "nx/looper.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+class Handler;
+
+/// @brief A buffer to register with IoRing::registerBuffers().
+struct IoBuffer {
+  void* data;
+  std::size_t size;
+};
+
+/// @brief One read or write.  It must stay alive until its completion has
+/// been handled.
+struct IoRequest {
+  enum class Operation {
+    kRead,
+    kWrite
+  };
+
+  IoRequest();
+
+  Operation operation;
+  int fd;
+  std::uint64_t offset;
+  void* buffer;
+  std::size_t length;
+  /// @brief The index of the registered buffer that [buffer, buffer + length)
+  /// lies within, or -1 if it isn't registered.  Defaults to -1.
+  int bufferIndex;
+  /// @brief Receives Message(messageId, this) once the request completes.
+  /// If its looper turns the message away, being bounded and full or having
+  /// quit, the completion is lost and counted by IoRing::lostCompletions();
+  /// the request is then done with all the same.
+  Handler* handler;
+  unsigned int messageId;
+  /// @brief Set before the completion is sent: the number of bytes
+  /// transferred, or a negated errno value.
+  std::int32_t result;
+  void* userData;
+};
+
+/// @brief An io_uring instance whose completions are reaped on a looper's
+/// thread, which must have been created with LooperOptions::eventPoller.
+/// Submitting is safe from any thread; the ring must be destroyed on the
+/// looper's thread or after it has quit.
+class IoRing {
+  Looper* const looper_;
+  int ringFd_;
+  int eventFd_;
+  void* sqRing_;
+  std::size_t sqRingSize_;
+  void* cqRing_;
+  std::size_t cqRingSize_;
+  void* sqes_;
+  std::size_t sqesSize_;
+  // pointers into the mapped rings
+  unsigned int* sqHead_;
+  unsigned int* sqTail_;
+  unsigned int sqMask_;
+  unsigned int* sqArray_;
+  unsigned int* cqHead_;
+  unsigned int* cqTail_;
+  unsigned int cqMask_;
+  void* cqes_;
+  unsigned int cqEntries_;
+
+  std::mutex submitMutex_;
+  // Submitted but not yet reaped; kept within cqEntries_ so that the
+  // completion queue can't overflow.
+  std::atomic<unsigned int> inFlight_;
+  std::atomic<std::uint64_t> lostCompletions_;
+
+  void unmap();
+  /// @brief Fills submission queue entries for as many of the requests as
+  /// fit, without a system call; submitMutex_ must be held.
+  /// @return The number placed.
+  std::size_t place(IoRequest* const* requests, std::size_t count);
+  /// @brief Sends every available completion to its handler.
+  void reap();
+  /// @brief Hands the kernel anything still queued, then waits for, and
+  /// discards, all outstanding completions.
+  void abandon();
+
+ public:
+  /// @brief Returns whether this platform and kernel support io_uring.
+  static bool supported();
+
+  /// @throws std::system_error if io_uring is unavailable or the looper
+  /// isn't able to watch descriptors.
+  explicit IoRing(Looper* looper, unsigned int entries = 64);
+  ~IoRing();
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  /// @brief Registers buffers for use with IoRequest::bufferIndex, replacing
+  /// any that were registered before.  Must not be called while requests
+  /// are in flight.
+  bool registerBuffers(const std::vector<IoBuffer>& buffers);
+  /// @brief Submits as many of the requests as fit, in order, with a single
+  /// system call, along with any queue()d before them.  Requests the kernel
+  /// refuses outright are taken back and not counted; ones it merely can't
+  /// take yet, as on EBUSY, stay queued.
+  /// @return The number submitted.
+  std::size_t submit(IoRequest* const* requests, std::size_t count);
+  bool submit(IoRequest* request);
+  /// @brief Queues as many of the requests as fit without a system call, to
+  /// be submitted along with the next submit(), so that several batches can
+  /// share one.
+  /// @return The number queued.
+  std::size_t queue(IoRequest* const* requests, std::size_t count);
+  /// @brief The number of requests whose completions have yet to be sent.
+  unsigned int inFlight() const;
+  /// @brief The number of completions whose handlers' loopers turned them
+  /// away.
+  std::uint64_t lostCompletions() const;
+};
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_IO_RING_H_
@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file latency_histogram.h
+/// @brief Log-linear histograms of how long messages wait and run.  The
+/// recording side is only compiled in when NX_LOOPER_LATENCY is defined.
+
+#ifndef INCLUDE_NX_LATENCY_HISTOGRAM_H_
+#define INCLUDE_NX_LATENCY_HISTOGRAM_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @brief A snapshot of a histogram of durations.  Each power of two range of
+/// nanoseconds is split into kSubBuckets equal buckets, so a bucket is never
+/// wider than 1/kSubBuckets of the values it holds.
+struct LatencyHistogram {
+  static constexpr unsigned int kSubBucketBits = 2;
+  static constexpr std::size_t kSubBuckets = 1u << kSubBucketBits;
+  /// @brief Enough for durations of over four hours; longer ones are
+  /// counted in the last bucket.
+  static constexpr std::size_t kBuckets = 44 * kSubBuckets;
+
+  LatencyHistogram();
+
+  /// @brief The number of durations recorded.
+  std::uint64_t count;
+  /// @brief Their sum and their maximum, in nanoseconds.
+  std::uint64_t total;
+  std::uint64_t max;
+  std::array<std::uint64_t, kBuckets> buckets;
+
+  /// @brief The bucket that holds the duration.
+  static std::size_t bucketOf(std::uint64_t nanoseconds);
+  /// @brief The smallest duration, in nanoseconds, that the bucket holds.
+  static std::uint64_t lowerBound(std::size_t bucket);
+  /// @return An upper bound for the quantile q, in [0, 1], or zero if the
+  /// histogram is empty.
+  std::chrono::nanoseconds percentile(double q) const;
+};
+
+/// @brief Histograms for one kind of message.
+struct MessageLatency {
+  /// @brief From when the message was due until it was dispatched.
+  LatencyHistogram queueDelay;
+  /// @brief How long dispatching it took.
+  LatencyHistogram execution;
+};
+
+/// @brief A snapshot of a Looper's latency histograms.  Taken while the
+/// looper is running, the counts may be slightly out of step with each
+/// other.
+struct LooperLatencyStatistics {
+  LooperLatencyStatistics();
+
+  /// @brief False unless built with NX_LOOPER_LATENCY and the looper was
+  /// created with LooperOptions::latencyHistograms.
+  bool enabled;
+  /// @brief Every message and callback dispatched.
+  MessageLatency all;
+  /// @brief Messages by id, in the order each id was first dispatched, for
+  /// up to a fixed number of ids; callbacks are only counted in all.
+  std::vector<std::pair<unsigned int, MessageLatency>> byId;
+};
+
+#ifdef NX_LOOPER_LATENCY
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Looper {
+
+/// @brief The live counters behind a LatencyHistogram.  Only the loop writes
+/// to them, so they are updated without read-modify-write operations.
+class LatencyCounters {
+  std::atomic<std::uint64_t> count_;
+  std::atomic<std::uint64_t> total_;
+  std::atomic<std::uint64_t> max_;
+  std::array<std::atomic<std::uint64_t>, LatencyHistogram::kBuckets> buckets_;
+
+ public:
+  LatencyCounters();
+  void record(std::uint64_t nanoseconds);
+  void snapshot(LatencyHistogram* histogram) const;
+};
+
+/// @brief Records the latencies of the messages a Looper dispatches.
+class LatencyRecorder {
+ public:
+  static constexpr std::size_t kTrackedIds = 32;
+
+ private:
+  struct Counters {
+    LatencyCounters queueDelay;
+    LatencyCounters execution;
+    void record(std::uint64_t queueDelay, std::uint64_t execution);
+    void snapshot(MessageLatency* latency) const;
+  };
+
+  Counters all_;
+  std::array<Counters, kTrackedIds> byId_;
+  std::array<std::atomic<unsigned int>, kTrackedIds> ids_;
+  // How many of byId_ are in use; published after the id is.
+  std::atomic<std::size_t> tracked_;
+  // Only touched by the loop.
+  std::unordered_map<unsigned int, std::size_t> slots_;
+
+ public:
+  LatencyRecorder();
+  LatencyRecorder(const LatencyRecorder&) = delete;
+  LatencyRecorder& operator=(const LatencyRecorder&) = delete;
+
+  /// @param id The message id, unless the message is a callback.
+  void record(bool isCallback, unsigned int id,
+      std::chrono::nanoseconds queueDelay, std::chrono::nanoseconds execution);
+  LooperLatencyStatistics snapshot() const;
+};
+
+}  // namespace Looper
+
+}  // namespace detail
+/// @endcond
+
+#endif  // NX_LOOPER_LATENCY
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_LATENCY_HISTOGRAM_H_
@@ -21,17 +21,27 @@
 #ifndef INCLUDE_NX_LOOPER_H_
 #define INCLUDE_NX_LOOPER_H_
 
+#include <array>
 #include <chrono>
-#include <map>
+#include <cstddef>
+#include <cstdint>
 #include <atomic>
+#include <functional>
 #include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
+#include "nx/event_poller.h"
+#include "nx/latency_histogram.h"
 #include "nx/message.h"
+#include "nx/message_queue.h"
 #include "nx/thread_compat.h"
+#include "nx/trace.h"
 
 /// @brief Library namespace.
 namespace nx {
@@ -47,45 +57,257 @@ class MessageEnvelope {
   const Message* message() const;
 };
 
+/// @brief How a Looper chooses between priority lanes that have messages due.
+enum class LaneSelection {
+  /// @brief The highest lane always goes first.
+  kStrict,
+  /// @brief Lanes take turns in proportion to LooperOptions::laneWeights.
+  kWeighted
+};
+
+/// @brief What Handler::replaceMessage() does when the message it replaces
+/// is due before the replacement.
+enum class ReplaceDeadline {
+  /// @brief The replacement keeps the earlier trigger time, so that a storm
+  /// of replacements can't hold the message back indefinitely.
+  kKeepEarlier,
+  /// @brief The replacement takes its own trigger time, pushing the message
+  /// back; this debounces it.
+  kPushLater
+};
+
+/// @brief When a periodic message is next due, once dispatched.
+enum class PeriodicPolicy {
+  /// @brief A period after it was last due, however late it ran, so that
+  /// it keeps to a fixed schedule.
+  kFixedRate,
+  /// @brief A period after its last dispatch finished.
+  kFixedDelay
+};
+
+/// @brief What a PeriodicPolicy::kFixedRate message does about the ticks it
+/// missed by running late.
+enum class MissedTicks {
+  /// @brief Skips them, continuing with the next tick still to come.
+  kSkip,
+  /// @brief Fires once for each, back to back, until caught up.
+  kFireAll
+};
+
+/// @brief What sending a message to a Looper whose queue is at capacity
+/// does.  Either way, the send returns false unless the message was queued.
+enum class OverflowPolicy {
+  /// @brief The send fails at once, leaving the caller to decide what to do.
+  kFailFast,
+  /// @brief The sender waits for room, for up to LooperOptions::sendTimeout.
+  /// The looper's own thread can't wait for itself, so it fails at once.
+  kBlock,
+  /// @brief The pending message for the same handler and id that was sent
+  /// first is dropped to make room; if there is none, the message being sent
+  /// is dropped instead.
+  kDropOldest,
+  /// @brief The message being sent is dropped.
+  kDropNewest
+};
+
+/// @brief Which watermark a Looper's queue depth has crossed.
+enum class QueuePressure {
+  /// @brief It has risen to LooperOptions::highWaterMark.
+  kHigh,
+  /// @brief Having been high, it has fallen to LooperOptions::lowWaterMark.
+  kLow
+};
+
+/// @brief Settings that determine how a Looper is constructed.
+struct LooperOptions {
+  LooperOptions();
+
+  /// @brief If set, delayed messages are parked in a hierarchical timing wheel
+  /// where scheduling and cancelling are O(1), and only enter the ordered
+  /// queue once they are about to fire.  Defaults to false.
+  bool timingWheel;
+  /// @brief The granularity of the timing wheel, which must be positive.
+  /// Defaults to 1ms.
+  std::chrono::nanoseconds timingWheelTick;
+  /// @brief The most messages that are taken from the queue under one lock
+  /// acquisition and clock sample, then dispatched in order while unlocked.
+  /// A message that has been taken can no longer be removed.  Defaults to 1.
+  std::size_t dispatchBatchLimit;
+  /// @brief If set, the loop stops sleeping once the next deadline is within
+  /// spinWindow and yields until it arrives, rather than relying on the
+  /// wakeup latency of the operating system.  Defaults to false.
+  bool highResolution;
+  /// @brief How close to a deadline a high resolution loop stops sleeping.
+  /// Defaults to 200us.
+  std::chrono::nanoseconds spinWindow;
+  /// @brief If set, and supported by the platform (linux), the loop sleeps in
+  /// epoll and is woken through an eventfd, which allows file descriptors to
+  /// be watched with Looper::addFd().  Defaults to false.
+  bool eventPoller;
+  /// @brief The number of priority lanes, chosen per message with
+  /// Message::setPriority().  Defaults to 1.
+  std::size_t priorityLanes;
+  /// @brief Defaults to LaneSelection::kStrict.
+  LaneSelection laneSelection;
+  /// @brief The weight of each lane for LaneSelection::kWeighted; lanes
+  /// without one, or with zero, weigh 1.
+  std::vector<unsigned int> laneWeights;
+  /// @brief If set, and built with NX_LOOPER_LATENCY, how long each message
+  /// waited and ran is recorded, for Looper::latencyStatistics().  This
+  /// costs a clock sample per message.  Defaults to false.
+  bool latencyHistograms;
+  /// @brief The most messages that may be pending at once, or 0 for no
+  /// limit.  Callbacks posted with Looper::post(), which continue work that
+  /// was already accepted, are never turned away but still count towards
+  /// it, as do periodic messages once queued.  Defaults to 0.
+  std::size_t capacity;
+  /// @brief Defaults to OverflowPolicy::kFailFast.
+  OverflowPolicy overflowPolicy;
+  /// @brief How long OverflowPolicy::kBlock waits for room.  Defaults to
+  /// std::chrono::nanoseconds::max(), to wait for as long as it takes.
+  std::chrono::nanoseconds sendTimeout;
+  /// @brief The depth at which PressureListeners are told of
+  /// QueuePressure::kHigh, or 0 for them never to be.  Defaults to 0.
+  std::size_t highWaterMark;
+  /// @brief The depth at which they are then told of QueuePressure::kLow;
+  /// kept below highWaterMark.  Defaults to 0.
+  std::size_t lowWaterMark;
+};
+
+/// @brief A snapshot of how many messages a Looper dispatches per batch.
+struct LooperBatchStatistics {
+  static constexpr std::size_t kBuckets = 16;
+
+  LooperBatchStatistics();
+
+  /// @brief The number of batches dispatched.
+  std::uint64_t batches;
+  /// @brief The number of messages dispatched.
+  std::uint64_t messages;
+  /// @brief The size of the largest batch.
+  std::uint64_t largest;
+  /// @brief histogram[i] counts batches with a size in [2^i, 2^(i+1)); the
+  /// last bucket also counts everything larger.
+  std::array<std::uint64_t, kBuckets> histogram;
+};
+
+/// @brief Process-wide counts of the allocations made for queued messages.
+/// Once loopers reach a steady state, sending and dispatching messages
+/// should leave them unchanged.
+struct LooperAllocationStatistics {
+  LooperAllocationStatistics();
+
+  /// @brief Queue nodes allocated, whether for a looper's pool or for
+  /// messages sent without its lock.
+  std::uint64_t nodes;
+  /// @brief Blocks allocated for payloads too large to be stored inline.
+  std::uint64_t payloadBlocks;
+};
+
+/// @brief A snapshot of how full a Looper's queue is, and what it turned
+/// away for lack of room.
+struct LooperQueueStatistics {
+  LooperQueueStatistics();
+
+  /// @brief The messages pending, not counting those being dispatched.
+  std::size_t depth;
+  /// @brief LooperOptions::capacity.
+  std::size_t capacity;
+  /// @brief Sends that failed for lack of room, other than by dropping.
+  std::uint64_t rejected;
+  /// @brief Messages dropped by OverflowPolicy::kDropOldest or kDropNewest.
+  std::uint64_t dropped;
+};
+
+/// @brief Told when a Looper's queue crosses its watermarks, so that
+/// producers can slow down and pick back up.
+class PressureListener {
+ public:
+  virtual ~PressureListener();
+  /// @brief Called on whichever thread moved the depth across the mark: a
+  /// sender for kHigh, usually the looper's thread for kLow.  The two
+  /// alternate, though calls on different threads may overlap.
+  /// @param depth The depth that crossed it.
+  virtual void onQueuePressure(QueuePressure pressure, std::size_t depth) = 0;
+};
+
+/// @brief Opportunistic work that a Looper runs once it has nothing due.
+class IdleHandler {
+ public:
+  virtual ~IdleHandler();
+  /// @brief Called on the looper's thread once per idle period, which ends
+  /// when a message is next dispatched.
+  /// @param budget How long until the next message is due, or
+  /// std::chrono::nanoseconds::max() if none are queued.
+  /// @return True to stay registered, false to be removed.
+  virtual bool queueIdle(std::chrono::nanoseconds budget) = 0;
+};
+
+/// @cond nx_detail
 namespace detail {
 
 namespace Looper {
 
-// Due to the having bidirectional mappings from the IdMap to the QueueType, a
-// forward declaration is required.
-class QueueData;
-
-typedef std::chrono::time_point<std::chrono::steady_clock> SteadyTimePoint;
-// http://www.open-std.org/jtc1/sc22/wg21/docs/lwg-defects.html#233
-// as of early c++0x drafts, the language dictating behavior with duplicate
-// keys has been clarified.  When inserting items of duplicate keys, they are
-// added in the insertion order, so you can rely upon that in c++11.
-typedef std::multimap<SteadyTimePoint, QueueData> QueueType;
-typedef QueueType::iterator QueueIterator;
-typedef std::multimap<unsigned int, QueueIterator> IdMapType;
-typedef IdMapType::iterator IdMapIterator;
-
-class QueueData {
+/// @brief The live counters behind LooperBatchStatistics.  Only the loop
+/// writes to them, so they are updated without read-modify-write operations.
+class BatchCounters {
+  std::atomic<std::uint64_t> batches_;
+  std::atomic<std::uint64_t> messages_;
+  std::atomic<std::uint64_t> largest_;
+  std::array<std::atomic<std::uint64_t>,
+      LooperBatchStatistics::kBuckets> histogram_;
+
  public:
-  explicit QueueData(MessageEnvelope envelope);
+  BatchCounters();
+  void record(std::size_t size);
+  LooperBatchStatistics snapshot() const;
+};
+
+/// @brief What the loop is dispatching, published for a Watchdog as a
+/// seqlock: only the loop writes to it, without read-modify-write
+/// operations, and readers retry if it changed while they read it.
+class DispatchBeacon {
+  // Odd while the loop is writing.
+  std::atomic<std::uint64_t> sequence_;
+  std::atomic<bool> active_;
+  std::atomic<const Handler*> handler_;
+  std::atomic<unsigned int> id_;
+  std::atomic<bool> isCallback_;
+  std::atomic<SteadyTimePoint::rep> start_;
+
+  void publish(bool active, const Handler* handler, unsigned int id,
+      bool isCallback, SteadyTimePoint start);
 
-  MessageEnvelope envelope_;
-  IdMapIterator idIterator_;
+ public:
+  struct Dispatch {
+    /// @brief Identifies this dispatch among those of the same looper.
+    std::uint64_t sequence;
+    const Handler* handler;
+    unsigned int id;
+    bool isCallback;
+    SteadyTimePoint start;
+  };
+
+  DispatchBeacon();
+  void begin(const Handler* handler, unsigned int id, bool isCallback,
+      SteadyTimePoint start);
+  void end();
+  /// @return False if the loop isn't dispatching, or was too busy changing
+  /// what it is dispatching for a consistent read.
+  bool read(Dispatch* dispatch) const;
 };
 
 }  // namespace Looper
 
 }  // namespace detail
+/// @endcond
 
-class Looper {
+class Looper : public std::enable_shared_from_this<Looper> {
   thread_local static std::shared_ptr<Looper> looper_;
   std::thread::id threadId_;
 
-  typedef detail::Looper::QueueData QueueData;
-  typedef detail::Looper::QueueType QueueType;
-  typedef detail::Looper::QueueIterator QueueIterator;
-  typedef detail::Looper::IdMapType IdMapType;
-  typedef detail::Looper::IdMapIterator IdMapIterator;
+  typedef detail::Looper::Node Node;
+  typedef detail::Looper::MessageQueue MessageQueue;
 
   std::mutex mutex_;
   std::condition_variable conditionVariable_;
@@ -93,20 +315,85 @@ class Looper {
 
   std::atomic_bool hasLooped_;
   std::atomic_bool isQuitting_;
+  // Set while the loop is waiting, so that lock-free senders know they must
+  // wake it.
+  std::atomic_bool isSleeping_;
 
  private:
-  QueueType messageQueue_;
-  IdMapType messageIdMap_;
-
-  Looper();
+  MessageQueue messageQueue_;
+  const std::size_t dispatchBatchLimit_;
+  // Zero unless high resolution timing was requested.
+  const std::chrono::nanoseconds spinWindow_;
+  // The messages taken from the queue for the current batch.
+  std::vector<Node*> batch_;
+  detail::Looper::BatchCounters batchCounters_;
+  // When the loop will next wake up on its own; senders only need to notify
+  // if their message is due before this.
+  detail::Looper::SteadyTimePoint nextWakeup_;
+  const OverflowPolicy overflowPolicy_;
+  const std::chrono::nanoseconds sendTimeout_;
+  // Senders blocked waiting for room, signalled whenever the lock holder
+  // makes some while this is nonzero.
+  std::condition_variable roomConditionVariable_;
+  unsigned int blockedSenders_;
+  // Only written under the lock, without read-modify-write operations.
+  std::atomic<std::uint64_t> rejected_;
+  std::atomic<std::uint64_t> dropped_;
+  // Zero unless watermarks were requested.
+  const std::size_t highWaterMark_;
+  const std::size_t lowWaterMark_;
+  // Set from when the depth reaches highWaterMark_ until it falls back to
+  // lowWaterMark_.
+  std::atomic_bool overHighWater_;
+  std::mutex pressureMutex_;
+  std::vector<PressureListener*> pressureListeners_;
 
  public:
   typedef detail::Looper::SteadyTimePoint SteadyTimePoint;
+  /// @brief Invoked on the looper's thread with the descriptor and the events
+  /// that occurred.  Returning false stops watching the descriptor.
+  typedef std::function<bool(int fd, unsigned int events)> FdCallback;
 
+  /// @brief Event flags for addFd(), with the same values as android's.
+  static constexpr unsigned int kEventInput = 1u << 0;
+  static constexpr unsigned int kEventOutput = 1u << 1;
+  static constexpr unsigned int kEventError = 1u << 2;
+  static constexpr unsigned int kEventHangup = 1u << 3;
+
+ private:
+  // Only present when LooperOptions::eventPoller is in effect.
+  std::unique_ptr<detail::Looper::EventPoller> poller_;
+  std::unordered_map<int, std::shared_ptr<FdCallback>> fdCallbacks_;
+  detail::Looper::EventPoller::ReadyList readyFds_;
+  struct FdDispatch {
+    int fd;
+    unsigned int events;
+    std::shared_ptr<FdCallback> callback;
+    bool keep;
+  };
+  std::vector<FdDispatch> fdDispatch_;
+  std::vector<IdleHandler*> idleHandlers_;
+  // The handlers being run, copied so that they can be called unlocked;
+  // guarded by mutex_, which removeIdleHandler() holds to clear its entry.
+  std::vector<IdleHandler*> idleRunning_;
+  // Set once a message has been dispatched since idle handlers last ran.
+  bool idlePending_;
+  // The number of watchdogs watching; the beacon is only lit while nonzero.
+  std::atomic<unsigned int> watchers_;
+  detail::Looper::DispatchBeacon beacon_;
+#ifdef NX_LOOPER_LATENCY
+  // Only present when latency histograms were requested.
+  std::unique_ptr<detail::Looper::LatencyRecorder> latency_;
+#endif
+
+  explicit Looper(const LooperOptions& options);
+
+ public:
   static std::shared_ptr<Looper> threadLooper();
 
-  // can be called more than once
-  static bool prepare();
+  // can be called more than once; options only apply to the first call.
+  // Throws std::invalid_argument if the options are out of range.
+  static bool prepare(const LooperOptions& options = LooperOptions());
 
   std::thread::id getThreadId() const;
 
@@ -116,19 +403,189 @@ class Looper {
   void quit();
   /// @brief Waits if the looper has not yet had loop() invoked.
   void waitForLoop();
+  /// @brief Safe to call from any thread.
+  LooperBatchStatistics batchStatistics() const;
+  /// @brief Safe to call from any thread.
+  static LooperAllocationStatistics allocationStatistics();
+  /// @brief Safe to call from any thread.
+  LooperLatencyStatistics latencyStatistics() const;
+  /// @brief The number of messages pending, as a single relaxed atomic read.
+  /// Safe to call from any thread.
+  std::size_t queueDepth() const;
+  /// @brief Safe to call from any thread.
+  LooperQueueStatistics queueStatistics() const;
+
+  /// @brief Runs callback on this looper's thread as soon as possible, as
+  /// with Handler::post() but without a handler.  It cannot be removed, and
+  /// if the looper quits first it is destroyed without being run.  Safe to
+  /// call from any thread.
+  /// @return False if the looper has quit.
+  template <typename F>
+  bool post(F&& callback) {
+    MessagePayload payload;
+    payload.emplaceCallback(std::forward<F>(callback));
+    return postCallback(&payload);
+  }
+
+  /// @brief Watches the descriptor for the kEvent* flags in events, invoking
+  /// the callback on this looper's thread whenever any occur.  Errors and
+  /// hangups are always reported.  Adding a descriptor that is already
+  /// watched replaces its events and callback.  Safe to call from any thread.
+  /// @return False if the looper was not created with
+  /// LooperOptions::eventPoller, or the descriptor can't be watched.
+  bool addFd(int fd, unsigned int events, FdCallback callback);
+  /// @brief Stops watching the descriptor.  Safe to call from any thread.
+  /// @return False if it was not being watched.
+  bool removeFd(int fd);
+
+  /// @brief Holds back every synchronous message sent to be dispatched after
+  /// now, while asynchronous ones continue to be dispatched, until the
+  /// barrier is removed.  Safe to call from any thread.
+  /// @return A token for removeSyncBarrier().
+  unsigned int postSyncBarrier();
+  /// @brief Safe to call from any thread.
+  /// @return False if there is no such barrier.
+  bool removeSyncBarrier(unsigned int token);
+
+  /// @brief Registers an idle handler, which must stay alive until it is
+  /// removed or the looper quits.  Safe to call from any thread.
+  void addIdleHandler(IdleHandler* idleHandler);
+  /// @brief Unregisters an idle handler, which won't be called again once
+  /// this returns, though a call that is already running on the looper's
+  /// thread is not waited for.  Safe to call from any thread.
+  void removeIdleHandler(IdleHandler* idleHandler);
+
+  /// @brief Registers a listener for the watermarks, which must stay alive
+  /// until it is removed or the looper is destroyed.  Safe to call from any
+  /// thread, other than from within a listener.
+  void addPressureListener(PressureListener* listener);
+  /// @brief Unregisters a listener.  A call already under way on another
+  /// thread is not waited for.  Safe to call from any thread, other than
+  /// from within a listener.
+  void removePressureListener(PressureListener* listener);
 
  private:
   void runLoop();
-  bool send(MessageEnvelope envelope, SteadyTimePoint triggerTime);
-  bool send(MessageEnvelope envelope, std::chrono::milliseconds delay);
+  /// @brief Sends the message, moving in the payload if there is one.
+  bool send(MessageEnvelope envelope, SteadyTimePoint triggerTime,
+      MessagePayload* payload = nullptr);
+  bool send(MessageEnvelope envelope,
+      std::chrono::steady_clock::duration delay,
+      MessagePayload* payload = nullptr);
+  /// @brief Sends every message in [first, last) to the handler under a
+  /// single lock acquisition, waking the loop at most once.  Stops at the
+  /// first that can't be queued, leaving those before it queued.
+  /// @return How many were sent.
+  template <typename Iterator>
+  std::size_t send(Handler* handler, Iterator first, Iterator last,
+      SteadyTimePoint triggerTime) {
+    std::size_t sent = 0;
+    { // arbitrary block
+      std::unique_lock<std::mutex> lock(mutex_);
+
+      if (!isAlive()) return 0;
+
+      for ( ; first != last; ++first) {
+        const Message& message = *first;
+        Node* node;
+        SteadyTimePoint deadline = SteadyTimePoint::min();
+        while (!(node = messageQueue_.push(handler, message, triggerTime))) {
+          if (!makeRoom(&lock, MessageEnvelope(handler, message),
+              &deadline)) {
+            break;
+          }
+        }
+        if (!node) {
+          break;
+        }
+        ++sent;
+        detail::Trace::onSend(this, node, handler, message);
+      }
+      if (sent && triggerTime < nextWakeup_) {
+        wake();
+      }
+    }
+    checkPressure();
+    return sent;
+  }
+  /// @brief Sends a message that is due immediately without taking the lock,
+  /// unless the loop is asleep and must be woken.
+  /// @param node A node from NodePool::obtain() to send the message in, or
+  /// nullptr for one to be obtained.  If sending fails, the caller keeps it.
+  bool sendNow(MessageEnvelope envelope, MessagePayload* payload = nullptr,
+      Node* node = nullptr);
+  /// @brief Sends a message with no handler, which runs the payload's
+  /// callback.
+  bool postCallback(MessagePayload* payload);
+  /// @brief Called with the lock held once pushing a message has found the
+  /// queue full, to make room as overflowPolicy_ dictates.
+  /// @param deadline When a blocked sender gives up; SteadyTimePoint::min()
+  /// until the first call for the message sets it.
+  /// @return True if the push should be retried, false if the message is not
+  /// to be sent.
+  bool makeRoom(std::unique_lock<std::mutex>* lock,
+      const MessageEnvelope& envelope, SteadyTimePoint* deadline);
+  /// @brief Wakes any senders blocked for room; the lock must be held.
+  void notifyRoom();
+  /// @brief Destroys the payloads of nodes from MessageQueue::takeRetired()
+  /// and gives the nodes back; the lock must not be held, since payloads can
+  /// run arbitrary code when destroyed.
+  void retire(Node* retired);
+  /// @brief Tells the listeners if the depth has crossed a watermark; the
+  /// lock must not be held.
+  void checkPressure();
+  /// @brief Wakes the loop; the lock must be held unless poller_ is set.
+  void wake();
+  void waitUntil(std::unique_lock<std::mutex>* lock,
+      SteadyTimePoint deadline);
+  /// @brief Checks watched descriptors without blocking.
+  void pollFds(std::unique_lock<std::mutex>* lock);
+  /// @brief Invokes the callbacks for readyFds_.
+  void dispatchFds(std::unique_lock<std::mutex>* lock);
+  static bool isPeriodic(const Node* node) {
+    return node->period_ != std::chrono::steady_clock::duration::zero();
+  }
+  /// @brief Runs the message's handler, or its callback if it has none.
+  void dispatch(Node* node);
+  /// @brief Dispatches batch_, until the looper quits.
+  void dispatchBatch();
+#ifdef NX_LOOPER_LATENCY
+  /// @brief As dispatchBatch(), recording each message's latency.
+  void dispatchTimed();
+#endif
+  /// @brief Runs every idle handler with the time left until deadline.
+  void runIdleHandlers(std::unique_lock<std::mutex>* lock,
+      SteadyTimePoint now, SteadyTimePoint deadline);
 
   void remove(Handler* handler, unsigned int id,
       bool checkData = false, void* data = nullptr);
+  void removeAllMessages(const Handler* handler);
+  bool removeCallback(const Handler* handler, unsigned int token);
+  bool hasCallback(const Handler* handler, unsigned int token);
   bool hasMessages(const Handler* handler, unsigned int id,
       bool checkData = false, void* data = nullptr);
+  /// @brief Sends the message unless one with the same handler and id is
+  /// pending, checking and sending under a single lock acquisition.
+  /// @return False if one was pending or the looper has quit.
+  bool sendIfAbsent(MessageEnvelope envelope, SteadyTimePoint triggerTime,
+      MessagePayload* payload = nullptr);
+  /// @brief Sends a message that is dispatched at triggerTime and then every
+  /// period, reusing its node, until removed.
+  /// @return False if the period isn't positive or the looper has quit.
+  bool sendPeriodic(MessageEnvelope envelope, SteadyTimePoint triggerTime,
+      std::chrono::steady_clock::duration period, PeriodicPolicy policy,
+      MissedTicks missedTicks, MessagePayload* payload = nullptr);
+  /// @brief Replaces the pending messages with the same handler and id with
+  /// this one, or sends it if there are none, under a single lock
+  /// acquisition.
+  bool replace(MessageEnvelope envelope, SteadyTimePoint triggerTime,
+      MessagePayload* payload, ReplaceDeadline deadline);
 
 
   friend class Handler;
+  friend class ResumeOn;
+  friend class Watchdog;
+  friend class detail::Looper::CallStateBase;
 };
 
 }  // namespace nx
@@ -20,12 +20,34 @@
 #ifndef INCLUDE_NX_MESSAGE_H_
 #define INCLUDE_NX_MESSAGE_H_
 
+#include "nx/message_payload.h"
+
 /// @brief Library namespace.
 namespace nx {
 
+class Handler;
+
+/// @cond nx_detail
+namespace detail {
+namespace Looper {
+class MessageQueue;
+}  // namespace Looper
+}  // namespace detail
+/// @endcond
+
 class Message {
   unsigned int id_;
   void* data_;
+  unsigned int priority_;
+  bool asynchronous_;
+  // Owned by the queued message; set by the queue when there is one.
+  MessagePayload* payload_;
+  // Set for callables posted with Handler::post(), whose id is their token.
+  bool callback_;
+
+  friend class detail::Looper::MessageQueue;
+  friend class Handler;
+
  public:
   explicit Message(unsigned int id = 0, void* data = nullptr);
   Message(const Message& message);
@@ -33,6 +55,25 @@ class Message {
   void setData(void* data);
   unsigned int id() const;
   void setId(unsigned int id);
+  /// @brief The priority lane the message is queued in, where 0 is the
+  /// highest; clamped to the lanes the looper has.  Defaults to 0.
+  unsigned int priority() const;
+  void setPriority(unsigned int priority);
+  /// @brief Asynchronous messages are not held back by sync barriers.
+  /// Defaults to false.
+  bool isAsynchronous() const;
+  void setAsynchronous(bool asynchronous);
+  /// @brief The payload the message was sent with, if it holds a T.  Only
+  /// valid while the message is being dispatched.
+  /// @return The payload, or nullptr if there is none or it holds another
+  /// type.
+  template <typename T>
+  T* payload() const {
+    return payload_ ? payload_->get<T>() : nullptr;
+  }
+  bool hasPayload() const;
+  /// @brief Whether this is a callable posted with Handler::post().
+  bool isCallback() const;
 };
 
 }  // namespace nx
@@ -0,0 +1,252 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file message_payload.h
+/// @brief Typed, move-only storage for what a message carries.
+
+#ifndef INCLUDE_NX_MESSAGE_PAYLOAD_H_
+#define INCLUDE_NX_MESSAGE_PAYLOAD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Payload {
+
+/// @brief Blocks for payloads too large to be stored inline, recycled by
+/// size class rather than returned to the allocator.  Safe to call from any
+/// thread.
+void* allocate(std::size_t size);
+void deallocate(void* block, std::size_t size);
+/// @brief The number of blocks ever allocated, rather than reused.
+std::uint64_t allocations();
+
+}  // namespace Payload
+
+}  // namespace detail
+/// @endcond
+
+/// @brief Holds a single object of any move constructible type.  Objects of
+/// up to kInlineSize bytes that can be moved without throwing are stored
+/// inline; larger ones go in a pooled block.
+class MessagePayload {
+ public:
+  static constexpr std::size_t kInlineSize = 48;
+
+ private:
+  struct Operations {
+    void (*destroy)(MessagePayload* payload);
+    // Moves the object from one payload into the other, which is empty.
+    void (*move)(MessagePayload* from, MessagePayload* to);
+    // Calls the object; only set for callbacks.
+    void (*invoke)(MessagePayload* payload);
+  };
+
+  template <typename T>
+  static constexpr bool storedInline() {
+    return sizeof(T) <= kInlineSize
+        && alignof(T) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible<T>::value;
+  }
+
+  template <typename T>
+  using Inline = std::integral_constant<bool, storedInline<T>()>;
+
+  template <typename T>
+  static void destroy(MessagePayload* payload, std::true_type) {
+    static_cast<T*>(payload->object_)->~T();
+  }
+  template <typename T>
+  static void destroy(MessagePayload* payload, std::false_type) {
+    T* object = static_cast<T*>(payload->object_);
+    object->~T();
+    detail::Payload::deallocate(object, sizeof(T));
+  }
+  template <typename T>
+  static void move(MessagePayload* from, MessagePayload* to,
+      std::true_type) {
+    T* object = static_cast<T*>(from->object_);
+    to->object_ = new (to->storage_) T(std::move(*object));
+    object->~T();
+  }
+  template <typename T>
+  static void move(MessagePayload* from, MessagePayload* to,
+      std::false_type) {
+    to->object_ = from->object_;
+  }
+  template <typename T, typename... Args>
+  void construct(std::true_type, Args&&... args) {
+    object_ = new (storage_) T(std::forward<Args>(args)...);
+  }
+  template <typename T, typename... Args>
+  void construct(std::false_type, Args&&... args) {
+    void* block = detail::Payload::allocate(sizeof(T));
+    try {
+      object_ = new (block) T(std::forward<Args>(args)...);
+    } catch (...) {
+      detail::Payload::deallocate(block, sizeof(T));
+      throw;
+    }
+  }
+
+  // One instance per type, so its address identifies the type held.
+  template <typename T>
+  static const Operations* operationsFor() {
+    static const Operations operations = {
+      [](MessagePayload* payload) {
+        destroy<T>(payload, Inline<T>());
+      },
+      [](MessagePayload* from, MessagePayload* to) {
+        move<T>(from, to, Inline<T>());
+      },
+      nullptr
+    };
+    return &operations;
+  }
+  // Distinct from operationsFor<T>(), so a callback never holds<T>().
+  template <typename T>
+  static const Operations* callbackOperationsFor() {
+    static const Operations operations = {
+      [](MessagePayload* payload) {
+        destroy<T>(payload, Inline<T>());
+      },
+      [](MessagePayload* from, MessagePayload* to) {
+        move<T>(from, to, Inline<T>());
+      },
+      [](MessagePayload* payload) {
+        (*static_cast<T*>(payload->object_))();
+      }
+    };
+    return &operations;
+  }
+
+  const Operations* operations_;
+  void* object_;
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+
+ public:
+  MessagePayload()
+      : operations_(nullptr)
+      , object_(nullptr) {
+  }
+  /// @brief Holds value, moved or copied in.
+  template <typename T, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<T>::type, MessagePayload>::value
+      >::type>
+  explicit MessagePayload(T&& value)
+      : MessagePayload() {
+    emplace<typename std::decay<T>::type>(std::forward<T>(value));
+  }
+  // Moving never throws: only types that move without throwing are stored
+  // inline, and the rest are moved by their pointer.
+  MessagePayload(MessagePayload&& other) noexcept
+      : MessagePayload() {
+    *this = std::move(other);
+  }
+  MessagePayload& operator=(MessagePayload&& other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.operations_) {
+        other.operations_->move(&other, this);
+        operations_ = other.operations_;
+        other.operations_ = nullptr;
+        other.object_ = nullptr;
+      }
+    }
+    return *this;
+  }
+  MessagePayload(const MessagePayload&) = delete;
+  MessagePayload& operator=(const MessagePayload&) = delete;
+  ~MessagePayload() {
+    reset();
+  }
+
+  /// @brief Replaces whatever is held with a T constructed from args.
+  template <typename T, typename... Args>
+  T& emplace(Args&&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+        "over-aligned payloads are not supported");
+    reset();
+    construct<T>(Inline<T>(), std::forward<Args>(args)...);
+    operations_ = operationsFor<T>();
+    return *static_cast<T*>(object_);
+  }
+  /// @brief Replaces whatever is held with callback, to be run by invoke().
+  template <typename F>
+  void emplaceCallback(F&& callback) {
+    typedef typename std::decay<F>::type Callback;
+    emplace<Callback>(std::forward<F>(callback));
+    operations_ = callbackOperationsFor<Callback>();
+  }
+  /// @brief Replaces whatever is held with a callback of type T, constructed
+  /// from args.
+  template <typename T, typename... Args>
+  T& emplaceCallback(Args&&... args) {
+    T& callback = emplace<T>(std::forward<Args>(args)...);
+    operations_ = callbackOperationsFor<T>();
+    return callback;
+  }
+  bool invocable() const {
+    return operations_ && operations_->invoke;
+  }
+  /// @brief Calls the callback held; invocable() must be true.
+  void invoke() {
+    operations_->invoke(this);
+  }
+  /// @brief Destroys whatever is held.
+  void reset() {
+    if (operations_) {
+      operations_->destroy(this);
+      operations_ = nullptr;
+      object_ = nullptr;
+    }
+  }
+  bool empty() const {
+    return operations_ == nullptr;
+  }
+  /// @brief Whether a T is held.
+  template <typename T>
+  bool holds() const {
+    return operations_ && operations_ == operationsFor<T>();
+  }
+  /// @return The T held, or nullptr if there isn't one.
+  template <typename T>
+  T* get() {
+    return holds<T>() ? static_cast<T*>(object_) : nullptr;
+  }
+  template <typename T>
+  const T* get() const {
+    return holds<T>() ? static_cast<const T*>(object_) : nullptr;
+  }
+  /// @return The callback held if it is a T, or nullptr.
+  template <typename T>
+  T* getCallback() {
+    return operations_ && operations_ == callbackOperationsFor<T>()
+        ? static_cast<T*>(object_) : nullptr;
+  }
+};
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_MESSAGE_PAYLOAD_H_
@@ -0,0 +1,459 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file message_queue.h
+/// @brief The pending message storage used by Looper.  Using this directly is
+/// not supported; create a HandlerThread.
+
+#ifndef INCLUDE_NX_MESSAGE_QUEUE_H_
+#define INCLUDE_NX_MESSAGE_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "nx/message.h"
+#include "nx/message_payload.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+class Handler;
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Looper {
+
+class TimingWheel;
+class CallStateBase;
+
+typedef std::chrono::time_point<std::chrono::steady_clock> SteadyTimePoint;
+
+/// @brief A single pending message.  Nodes are owned by a NodePool and their
+/// addresses are stable for as long as the pool exists.
+class Node {
+ public:
+  Node();
+
+  Handler* handler_;
+  Message message_;
+  /// @brief What message_.payload_ points to, if the message has a payload.
+  MessagePayload payload_;
+  SteadyTimePoint when_;
+  /// @brief Insertion order; breaks ties between equal trigger times.
+  std::uint64_t sequence_;
+  /// @brief Position within the heap, or kNotQueued.
+  std::size_t heapIndex_;
+  /// @brief Which of the MessageQueue's heaps the node belongs in, as
+  /// determined by its priority lane and whether it is asynchronous.
+  unsigned int heapSlot_;
+  /// @brief Intrusive links for the (handler, id) index; idNext_ doubles as
+  /// the free list link while the node is not in use.
+  Node* idPrev_;
+  Node* idNext_;
+  /// @brief Intrusive links for the handler index.
+  Node* handlerPrev_;
+  Node* handlerNext_;
+  /// @brief Intrusive links and (level, slot) index while parked in a
+  /// TimingWheel, or kNotParked.
+  Node* wheelPrev_;
+  Node* wheelNext_;
+  unsigned int wheelSlot_;
+  /// @brief Link while queued in an IntakeQueue.
+  std::atomic<Node*> intakeNext_;
+  /// @brief False if the node was allocated outside of a NodePool, in which
+  /// case releasing it recycles it.
+  bool pooled_;
+  /// @brief For a periodic message, the Periodic flags.
+  std::uint8_t periodic_;
+  /// @brief Nonzero for a periodic message, which is queued again in the
+  /// same node each time it has been dispatched.
+  std::chrono::steady_clock::duration period_;
+  /// @brief Set for the message of a Handler::call(), whose Future shares
+  /// the node; the state lives within payload_.
+  CallStateBase* callState_;
+  /// @brief While callState_ is set, how many of the queue and the Future
+  /// still hold the node.  The last to let go recycles it.
+  std::atomic<unsigned int> references_;
+#ifdef NX_LOOPER_TRACING
+  /// @brief Links the message's send to its dispatch in a trace; zero if it
+  /// was sent while not tracing.
+  std::uint64_t traceFlow_;
+#endif
+
+  enum Periodic : std::uint8_t {
+    // Each period starts once the last dispatch finishes, rather than from
+    // the time it was due.
+    kFixedDelay = 1,
+    // Ticks missed by a fixed rate message fire back to back, rather than
+    // being skipped.
+    kFireMissed = 2,
+    // Removed while being dispatched, so it must not be queued again.
+    kCancelled = 4
+  };
+
+  static constexpr std::size_t kNotQueued = static_cast<std::size_t>(-1);
+  static constexpr unsigned int kNotParked = static_cast<unsigned int>(-1);
+};
+
+/// @brief A slab of preallocated nodes.  Memory is allocated a chunk at a time
+/// and never returned until the pool is destroyed, so the steady state of
+/// acquire()/release() performs no allocation.
+///
+/// Nodes for messages sent without the lock come from obtain() instead, which
+/// is shared by every looper.  Each thread caches recycled nodes, trading
+/// them with other threads in batches through a global depot, so a producer
+/// that sends to a loop on another thread gets back the nodes the loop
+/// recycles.
+class NodePool {
+  static constexpr std::size_t kChunkSize = 256;
+
+  std::vector<std::unique_ptr<Node[]>> chunks_;
+  Node* freeList_;
+
+  void grow();
+
+ public:
+  NodePool();
+  NodePool(const NodePool&) = delete;
+  NodePool& operator=(const NodePool&) = delete;
+
+  Node* acquire();
+  /// @brief A node from outside of the pool, reused if possible; safe from
+  /// any thread.
+  static Node* obtain();
+  /// @brief Returns a node from obtain() for reuse; safe from any thread.
+  static void recycle(Node* node);
+  /// @brief Drops a reference to a node shared with a Future, recycling it
+  /// if it was the last; safe from any thread.
+  static void unshare(Node* node);
+  /// @brief The part of release() that can run arbitrary code: destroys the
+  /// payload or, for a call, abandons it, which may post its continuation.
+  /// Safe from any thread, and meant to be called without the Looper's lock.
+  /// @return True if the node came from acquire() and must still be given
+  /// back with release().
+  static bool retire(Node* node);
+  /// @brief Returns a node from acquire() to the pool, or recycles one from
+  /// obtain().
+  void release(Node* node);
+  /// @brief The number of nodes allocated so far, whether in use or not.
+  std::size_t capacity() const;
+  /// @brief The number of nodes ever allocated, by all pools and obtain().
+  static std::uint64_t allocations();
+};
+
+/// @brief A d-ary min-heap of nodes ordered by (when_, sequence_).  The sort
+/// keys are stored alongside the node pointer so that sifting never has to
+/// touch the nodes themselves, other than to record their new position.
+class NodeHeap {
+ public:
+  static constexpr std::size_t kArity = 4;
+
+ private:
+  struct Entry {
+    SteadyTimePoint when;
+    std::uint64_t sequence;
+    Node* node;
+  };
+  std::vector<Entry> entries_;
+
+  static bool before(const Entry& lhs, const Entry& rhs);
+  void place(std::size_t index, const Entry& entry);
+  void siftUp(std::size_t index);
+  void siftDown(std::size_t index);
+
+ public:
+  bool empty() const;
+  std::size_t size() const;
+  Node* top() const;
+
+  void push(Node* node);
+  /// @brief Removes the node from wherever it lies within the heap.
+  void erase(Node* node);
+  Node* pop();
+  void clear();
+};
+
+/// @brief An intrusive multi-producer, single-consumer queue of nodes, as
+/// described by Dmitry Vyukov.  Pushing is a fixed handful of atomic steps,
+/// one of them an exchange, and never waits on other producers or the
+/// consumer.  Once the consumer has closed it, pushes fail.
+class IntakeQueue {
+  // pushers_ counts pushes under way in steps of kPusher, with kClosed set
+  // once the queue is closed.
+  static const unsigned int kClosed = 1;
+  static const unsigned int kPusher = 2;
+
+  std::atomic<Node*> head_;
+  std::atomic<unsigned int> pushers_;
+  // Only touched by the consumer.
+  Node* tail_;
+  Node stub_;
+
+  /// @brief Appends the node, whether or not the queue is closed.
+  void link(Node* node);
+
+ public:
+  IntakeQueue();
+  IntakeQueue(const IntakeQueue&) = delete;
+  IntakeQueue& operator=(const IntakeQueue&) = delete;
+
+  /// @brief Safe to call from any thread.
+  /// @return False if the queue has been closed.
+  bool push(Node* node);
+  /// @brief Consumer only.
+  /// @return The oldest node, or nullptr if the queue is empty or the next
+  /// producer in line has not finished its push.
+  Node* pop();
+  /// @brief Consumer only.  Meaningful once pop() has returned nullptr, to
+  /// tell an empty queue apart from an unfinished push.
+  bool empty() const;
+  /// @brief Consumer only.  Turns away every later push, then waits for
+  /// those already under way, which can still be popped, to finish.
+  void close();
+};
+
+/// @brief The queue of pending messages for a Looper.  Other than where noted,
+/// not thread-safe; the Looper serializes access.
+///
+/// Messages are split into priority lanes, each with a heap for synchronous
+/// and one for asynchronous messages.  Sync barriers hold back every
+/// synchronous message ordered after them, in all lanes.
+class MessageQueue {
+  // Callbacks are keyed apart from messages, by their token.
+  struct IdKey {
+    const Handler* handler;
+    unsigned int id;
+    bool callback;
+    bool operator==(const IdKey& other) const;
+  };
+  struct IdKeyHash {
+    std::size_t operator()(const IdKey& key) const;
+  };
+  typedef std::unordered_map<IdKey, Node*, IdKeyHash> IdIndexType;
+  typedef std::unordered_map<const Handler*, Node*> HandlerIndexType;
+
+  struct Barrier {
+    SteadyTimePoint when;
+    std::uint64_t sequence;
+    unsigned int token;
+  };
+
+  NodePool pool_;
+  // Indexed by Node::heapSlot_; the synchronous heap of each lane is followed
+  // by its asynchronous one.
+  std::vector<NodeHeap> heaps_;
+  // Empty for strict priority, otherwise the weight of each lane.
+  std::vector<unsigned int> laneWeights_;
+  // Smooth weighted round robin state for each lane.
+  std::vector<std::int64_t> laneCredits_;
+  // Ordered by (when, sequence); only the first one has any effect.
+  std::vector<Barrier> barriers_;
+  unsigned int nextBarrierToken_;
+  // Only present when enabled; parks messages until they are about to fire.
+  std::unique_ptr<TimingWheel> wheel_;
+  // Heads of intrusive lists of the pending nodes for each (handler, id) and
+  // for each handler.  Empty lists are kept so that a pair that is repeatedly
+  // sent and dispatched does not allocate; they are swept once they
+  // outnumber the pending messages.
+  IdIndexType idIndex_;
+  HandlerIndexType handlerIndex_;
+  std::atomic<std::uint64_t> nextSequence_;
+  // The messages pending, including those posted but not yet drained; room
+  // is reserved before a message is queued, so it never exceeds capacity_.
+  std::atomic<std::size_t> depth_;
+  // Zero for no limit.
+  std::size_t capacity_;
+  // Messages posted without the lock, waiting to be moved into the heap.
+  IntakeQueue intake_;
+  // Periodic nodes that have been taken to be dispatched, so that removing
+  // their messages can stop them from being queued again.
+  std::vector<Node*> running_;
+  // Nodes removed from the queue, linked through idNext_, whose payloads are
+  // left for takeRetired() to hand to the caller to destroy unlocked.
+  Node* retired_;
+
+  static void assign(Node* node, Handler* handler, const Message& message,
+      SteadyTimePoint when, MessagePayload* payload);
+  void insert(Node* node);
+  /// @brief Whether a sync barrier holds the node back.
+  bool blocked(const Node* node) const;
+  /// @brief The next node of the lane that isn't held back, or nullptr.
+  Node* laneTop(std::size_t lane) const;
+  Node* take(Node* node);
+  void link(Node* node);
+  void unlink(Node* node);
+  /// @brief Takes the node out of wherever it is queued, leaving it to the
+  /// caller.
+  void detach(Node* node);
+  /// @brief Adds a node that is no longer queued to the retired list.
+  void retireLater(Node* node);
+  /// @brief Takes the node out of wherever it is queued and retires it.
+  void discard(Node* node);
+  void sweepIdIndex();
+  static IdKey keyOf(const Node* node);
+  std::size_t remove(const IdKey& key, bool checkData, void* data);
+  bool contains(const IdKey& key, bool checkData, void* data) const;
+  /// @brief Cancels the running periodic nodes that match.
+  std::size_t cancelRunning(const IdKey& key, bool checkData, void* data);
+
+ public:
+  MessageQueue();
+  ~MessageQueue();
+
+  /// @brief Parks messages whose deadline is more than a tick away in a
+  /// timing wheel, rather than the heap.  Must be called while empty.
+  void enableTimingWheel(SteadyTimePoint origin,
+      std::chrono::nanoseconds tick);
+  /// @brief Splits the queue into count priority lanes, where lane 0 is the
+  /// highest.  With no weights, the highest lane with a message due always
+  /// goes first; otherwise lanes with messages due take turns in proportion
+  /// to their weights.  Must be called while empty.
+  void setLanes(std::size_t count, const std::vector<unsigned int>& weights);
+  std::size_t lanes() const;
+  /// @brief Limits how many messages may be pending, or removes the limit if
+  /// capacity is zero.  Must be called while empty.
+  void setCapacity(std::size_t capacity);
+  std::size_t capacity() const;
+  /// @brief The number of messages pending, counting those posted and not
+  /// yet drained but not those being dispatched.  Safe to call from any
+  /// thread.
+  std::size_t depth() const;
+  /// @brief Whether there is no room left for another message.  Safe to call
+  /// from any thread.
+  bool full() const;
+  /// @brief Claims room for a message, as post() requires.  Safe to call from
+  /// any thread.
+  /// @param force If set, room is claimed even if the queue is full.
+  /// @return False if the queue is full and force was not set.
+  bool reserve(bool force = false);
+
+  bool empty() const;
+  std::size_t size() const;
+  /// @brief The earliest node, among those that are ready to be ordered and
+  /// not held back by a barrier, or nullptr if there are none.
+  Node* top() const;
+  /// @brief Moves any parked messages that are about to fire into the heap.
+  void advance(SteadyTimePoint now);
+  /// @brief The time at which top() or advance() next needs attention, or
+  /// SteadyTimePoint::max() if empty.
+  SteadyTimePoint nextEvent() const;
+
+  /// @brief Queues the message, taking the payload if there is one.
+  /// @return The node that now holds the message, or nullptr if the queue is
+  /// full, in which case the payload is left with the caller.
+  Node* push(Handler* handler, const Message& message, SteadyTimePoint when,
+      MessagePayload* payload = nullptr);
+  /// @brief Queues a node from NodePool::obtain() without requiring the
+  /// caller to hold the Looper's lock, into room the caller has reserve()d.
+  /// The message is not visible until the next drain().  Safe to call from
+  /// any thread.
+  /// @return False if the queue has been closed, in which case the payload
+  /// is moved back, the room is given back and the caller keeps the node.
+  bool post(Node* node, Handler* handler, const Message& message,
+      SteadyTimePoint when, MessagePayload* payload = nullptr);
+  /// @brief Queues the message unless one with the same handler and id is
+  /// pending, found through the index.  Anything posted must have been
+  /// drained.
+  /// @return The node that now holds the message, or nullptr if one was
+  /// pending or the queue is full, in which case the payload is left with the
+  /// caller.
+  Node* pushIfAbsent(Handler* handler, const Message& message,
+      SteadyTimePoint when, MessagePayload* payload = nullptr);
+  /// @brief Replaces the pending messages with the same handler and id with
+  /// this one, in place of the earliest due of them, or queues it if there
+  /// are none.  Anything posted must have been drained.
+  /// @param keepEarlier If set, the replacement keeps the pending message's
+  /// trigger time, and its place among messages due at the same time, if
+  /// that is earlier than when.
+  /// @return The node that now holds the message, or nullptr if there were
+  /// none and the queue is full.
+  Node* replace(Handler* handler, const Message& message,
+      SteadyTimePoint when, MessagePayload* payload, bool keepEarlier);
+  /// @brief Queues a message that is dispatched at when and then every
+  /// period, in the same node, until removed.
+  /// @param flags Any of Node::kFixedDelay and Node::kFireMissed.
+  /// @return The node that now holds the message, or nullptr if the queue is
+  /// full.  Once queued, it is always queued again regardless of capacity.
+  Node* pushPeriodic(Handler* handler, const Message& message,
+      SteadyTimePoint when, std::chrono::steady_clock::duration period,
+      std::uint8_t flags, MessagePayload* payload = nullptr);
+  /// @brief Queues a periodic node again once it has been dispatched, due a
+  /// period after it was last due, or after now for fixed delays; if it was
+  /// removed meanwhile, releases it instead.
+  void requeue(Node* node, SteadyTimePoint now);
+  /// @brief Moves everything that has been posted into the queue proper.
+  void drain();
+  /// @brief Whether anything has been posted since the last drain().
+  bool drained() const;
+  /// @brief Turns away every later post(), then drains, for once the loop
+  /// will no longer run.
+  void close();
+  /// @brief Dequeues top().  The node remains valid until it is given back
+  /// with release(), or requeue() if periodic.
+  Node* pop();
+  /// @brief Dequeues the next node due as of now, choosing between lanes.
+  /// @return The node, or nullptr if none are due.
+  Node* pop(SteadyTimePoint now);
+  void release(Node* node);
+  /// @brief Hands over the nodes removed since the last call, linked through
+  /// idNext_.  Each must be given to NodePool::retire() and, if that returns
+  /// true, then to release().
+  Node* takeRetired();
+
+  /// @brief Holds back synchronous messages ordered after when, until the
+  /// barrier is removed.
+  /// @return A token that identifies the barrier.
+  unsigned int postBarrier(SteadyTimePoint when);
+  /// @return False if there is no such barrier.
+  bool removeBarrier(unsigned int token);
+
+  /// @brief Removes every pending message for the handler with the given id
+  /// and, if checkData is set, with matching data.  Takes time in proportion
+  /// to the messages for that handler and id.
+  /// @return The number of messages removed.
+  std::size_t remove(const Handler* handler, unsigned int id,
+      bool checkData = false, void* data = nullptr);
+  /// @brief Removes the callback with the given token.
+  /// @return False if it is no longer pending.
+  bool removeCallback(const Handler* handler, unsigned int token);
+  bool containsCallback(const Handler* handler, unsigned int token) const;
+  /// @brief Removes every pending message for the handler, in time
+  /// proportional to their number.
+  /// @return The number of messages removed.
+  std::size_t removeAll(const Handler* handler);
+  /// @brief Removes the message for the handler with the given id that was
+  /// sent first.
+  /// @return False if there is none pending.
+  bool removeOldest(const Handler* handler, unsigned int id);
+  bool contains(const Handler* handler, unsigned int id,
+      bool checkData = false, void* data = nullptr) const;
+  void clear();
+};
+
+}  // namespace Looper
+
+}  // namespace detail
+/// @endcond
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_MESSAGE_QUEUE_H_
@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file native_thread.h
+/// @brief Control over the OS thread behind a HandlerThread: its name, which
+/// CPUs it runs on, how it is scheduled and its stack size.  Only supported
+/// on Linux; elsewhere, anything but the defaults fails.
+
+#ifndef INCLUDE_NX_NATIVE_THREAD_H_
+#define INCLUDE_NX_NATIVE_THREAD_H_
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "nx/thread_compat.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @brief The scheduling policies of Linux.
+enum class ThreadScheduling {
+  /// @brief Whatever the thread that creates it has.
+  kInherit,
+  kOther,
+  /// @brief For throughput work that shouldn't disturb interactive threads.
+  kBatch,
+  /// @brief Only runs when nothing else wants the CPU.
+  kIdle,
+  /// @brief Real-time, first in first out; usually requires privileges.
+  kFifo,
+  /// @brief Real-time, round robin; usually requires privileges.
+  kRoundRobin
+};
+
+/// @brief How a HandlerThread's OS thread is set up.
+struct ThreadOptions {
+  ThreadOptions();
+
+  /// @brief The name the OS shows for the thread, truncated to 15
+  /// characters.  Defaults to the HandlerThread's name.
+  std::string name;
+  /// @brief The CPUs the thread may run on.  Defaults to empty, for those of
+  /// the thread that creates it.
+  std::vector<unsigned int> cpuAffinity;
+  /// @brief Defaults to ThreadScheduling::kInherit.
+  ThreadScheduling scheduling;
+  /// @brief For kFifo and kRoundRobin, the real-time priority, from 1 to 99;
+  /// for kOther and kBatch, the nice value, from -20 to 19.  Ignored
+  /// otherwise.  Defaults to 0.
+  int priority;
+  /// @brief The stack size in bytes, or 0 for the default.
+  std::size_t stackSize;
+};
+
+/// @brief The settings in effect for a thread, as read back from the OS.
+struct ThreadSettings {
+  ThreadSettings();
+
+  /// @brief The kernel's id for the thread, as listed in /proc/self/task.
+  int nativeId;
+  std::string name;
+  std::vector<unsigned int> cpuAffinity;
+  ThreadScheduling scheduling;
+  /// @brief The real-time priority or nice value, as for ThreadOptions.
+  int priority;
+  std::size_t stackSize;
+};
+
+/// @cond nx_detail
+namespace detail {
+
+/// @brief A joinable thread that, unlike std::thread, can be given a stack
+/// size.
+class NativeThread {
+  std::function<void()> function_;
+  std::thread::native_handle_type handle_;
+  bool joinable_;
+  std::atomic<int> nativeId_;
+#if !defined(__linux__)
+  std::thread thread_;
+#endif
+
+  static void* start(void* self);
+
+ public:
+  /// @brief Runs function on a new thread.  Throws std::system_error if the
+  /// thread can't be started.
+  NativeThread(std::function<void()> function, std::size_t stackSize);
+  NativeThread(const NativeThread&) = delete;
+  NativeThread& operator=(const NativeThread&) = delete;
+  /// @brief Joins the thread if it hasn't been, ignoring any error.
+  ~NativeThread();
+
+  bool joinable() const;
+  void join();
+  /// @brief Reads the thread's settings back from the OS.
+  ThreadSettings settings() const;
+
+  /// @brief Applies the options, other than the stack size, to the calling
+  /// thread.
+  /// @return The first error, if any could not be applied.
+  static std::error_code applyToCurrentThread(const ThreadOptions& options);
+};
+
+}  // namespace detail
+/// @endcond
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_NATIVE_THREAD_H_
@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file timing_wheel.h
+/// @brief A hierarchical timing wheel used by Looper to park delayed
+/// messages.  Using this directly is not supported; create a HandlerThread.
+
+#ifndef INCLUDE_NX_TIMING_WHEEL_H_
+#define INCLUDE_NX_TIMING_WHEEL_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "nx/message_queue.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Looper {
+
+/// @brief Hashed, hierarchical timing wheel in the style of Varghese & Lauck.
+///
+/// Each level has kSlots slots of intrusive lists, and each slot of a level
+/// spans all of the slots of the level below it.  Inserting and erasing are
+/// O(1).  Nodes are only handed to the heap once the tick containing their
+/// deadline arrives, so the ordering of nodes that fire is still exact.
+class TimingWheel {
+ public:
+  static constexpr unsigned int kSlotBits = 6;
+  static constexpr unsigned int kSlots = 1u << kSlotBits;
+  static constexpr unsigned int kLevels = 4;
+
+ private:
+  SteadyTimePoint origin_;
+  std::chrono::nanoseconds tick_;
+  // The last tick that has been fully processed.
+  std::uint64_t current_;
+  std::size_t size_;
+  Node* slots_[kLevels][kSlots];
+  // A set bit means the corresponding slot is not empty.
+  std::uint64_t occupied_[kLevels];
+
+  std::uint64_t tickOf(SteadyTimePoint when) const;
+  std::uint64_t nextEventTick() const;
+  void link(Node* node, unsigned int level, unsigned int slot);
+  void bin(Node* node, NodeHeap* heaps);
+  void process(std::uint64_t tick, NodeHeap* heaps);
+
+ public:
+  /// @throws std::invalid_argument unless tick is positive.
+  TimingWheel(SteadyTimePoint origin, std::chrono::nanoseconds tick);
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  bool empty() const;
+  std::size_t size() const;
+  static bool contains(const Node* node);
+
+  /// @brief Parks the node if its deadline lies beyond the next tick and
+  /// within the span of the wheel.
+  /// @return False if the node was not taken and belongs in the heap.
+  bool insert(Node* node);
+  void erase(Node* node);
+  /// @brief Moves every node whose tick has arrived by now into the heap,
+  /// within the array heaps, that is selected by its Node::heapSlot_.
+  void advance(SteadyTimePoint now, NodeHeap* heaps);
+  /// @brief The time by which advance() must next be called, or
+  /// SteadyTimePoint::max() if the wheel is empty.
+  SteadyTimePoint nextEvent() const;
+  /// @brief Removes and returns any parked node, or nullptr if empty.
+  Node* extract();
+};
+
+}  // namespace Looper
+
+}  // namespace detail
+/// @endcond
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_TIMING_WHEEL_H_
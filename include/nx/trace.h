@@ -0,0 +1,167 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file trace.h
+/// @brief Traces of Looper activity, in the Chrome trace event format that
+/// Perfetto and chrome://tracing load.  Recording is only compiled in when
+/// NX_LOOPER_TRACING is defined.
+
+#ifndef INCLUDE_NX_TRACE_H_
+#define INCLUDE_NX_TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "nx/message.h"
+#include "nx/message_queue.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+enum class TraceEventType : std::uint8_t {
+  kSend,
+  kDispatchBegin,
+  kDispatchEnd,
+  kRemove
+};
+
+/// @brief Records what every Looper sends, dispatches and removes into a ring
+/// buffer per thread, linking each send to its dispatch.
+class Tracer {
+ public:
+  /// @brief How many of its latest events each thread keeps.
+  static constexpr std::size_t kEventsPerThread = 1u << 15;
+
+  /// @return False unless built with NX_LOOPER_TRACING.
+  static bool start();
+  static void stop();
+  static bool isTracing();
+  /// @brief Names the calling thread in traces; a HandlerThread names its
+  /// own.
+  static void setThreadName(const std::string& name);
+  /// @brief Discards what has been recorded.  Only call while stopped.
+  static void clear();
+  /// @brief Writes what has been recorded as a JSON trace.  Only call while
+  /// stopped, as events being recorded meanwhile may be torn.
+  static void writeChromeTrace(std::ostream& os);
+};
+
+/// @cond nx_detail
+namespace detail {
+
+namespace Trace {
+
+enum Flags : std::uint8_t {
+  kCallback = 1,
+  // A removal of every message for the handler.
+  kAllMessages = 2
+};
+
+#ifdef NX_LOOPER_TRACING
+
+struct Event {
+  std::int64_t timestamp;
+  // Links a send to its dispatch; zero for removals.
+  std::uint64_t flow;
+  const void* looper;
+  const void* handler;
+  unsigned int id;
+  TraceEventType type;
+  std::uint8_t flags;
+};
+
+/// @brief A thread's events.  Only that thread writes to it, and it is kept
+/// once the thread exits so that its events can still be written out.
+class Buffer {
+  // Allocated by the first event, so that naming a thread costs little.
+  std::unique_ptr<Event[]> events_;
+  // How many events have ever been appended; the latest kEventsPerThread are
+  // kept.
+  std::atomic<std::uint64_t> head_;
+  std::uint64_t nextFlow_;
+
+ public:
+  /// @brief Distinguishes the thread in traces, and prefixes its flows.
+  const std::uint64_t index;
+  /// @brief Guarded by the registry.
+  std::string name;
+  std::atomic<bool> retired;
+
+  explicit Buffer(std::uint64_t index);
+  void append(const Event& event);
+  std::uint64_t nextFlow();
+  std::uint64_t head() const;
+  /// @brief Only valid for the latest kEventsPerThread events below head().
+  const Event& at(std::uint64_t position) const;
+  void clear();
+};
+
+extern std::atomic<bool> tracing;
+
+void record(TraceEventType type, const void* looper, const void* handler,
+    unsigned int id, std::uint8_t flags, std::uint64_t flow);
+/// @brief A flow for a send from the calling thread.
+std::uint64_t nextFlow();
+
+inline std::uint8_t flagsOf(const Handler* handler, const Message& message) {
+  return !handler || message.isCallback() ? kCallback : 0;
+}
+
+#endif  // NX_LOOPER_TRACING
+
+/// @brief The Looper's recording hooks, which do nothing unless tracing.
+inline void onSend(const void* looper, Looper::Node* node,
+    const Handler* handler, const Message& message) {
+#ifdef NX_LOOPER_TRACING
+  node->traceFlow_ = 0;
+  if (tracing.load(std::memory_order_relaxed)) {
+    node->traceFlow_ = nextFlow();
+    record(TraceEventType::kSend, looper, handler, message.id(),
+        flagsOf(handler, message), node->traceFlow_);
+  }
+#endif
+}
+inline void onDispatch(TraceEventType type, const void* looper,
+    const Looper::Node* node) {
+#ifdef NX_LOOPER_TRACING
+  if (tracing.load(std::memory_order_relaxed)) {
+    record(type, looper, node->handler_, node->message_.id(),
+        flagsOf(node->handler_, node->message_), node->traceFlow_);
+  }
+#endif
+}
+/// @param flags Zero, or either of kCallback or kAllMessages.
+inline void onRemove(const void* looper, const Handler* handler,
+    unsigned int id, std::uint8_t flags) {
+#ifdef NX_LOOPER_TRACING
+  if (tracing.load(std::memory_order_relaxed)) {
+    record(TraceEventType::kRemove, looper, handler, id, flags, 0);
+  }
+#endif
+}
+
+}  // namespace Trace
+
+}  // namespace detail
+/// @endcond
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_TRACE_H_
@@ -0,0 +1,118 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file watchdog.h
+/// @brief Flags messages that take too long to dispatch.
+
+#ifndef INCLUDE_NX_WATCHDOG_H_
+#define INCLUDE_NX_WATCHDOG_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nx/handler.h"
+#include "nx/looper.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+/// @brief A dispatch that overran the watchdog's budget.
+struct SlowDispatch {
+  /// @brief The name the looper was watched under.
+  std::string looperName;
+  /// @brief Null for callbacks posted to the looper itself.
+  const Handler* handler;
+  /// @brief Zero for callbacks.
+  unsigned int messageId;
+  bool isCallback;
+  /// @brief How long the dispatch had been running when it was flagged; it
+  /// may well run for longer.
+  std::chrono::nanoseconds elapsed;
+};
+
+/// @brief Watches loopers from a thread of its own, flagging each dispatch
+/// that runs for longer than the budget once.  The loopers only publish
+/// what they are dispatching while watched, without taking any locks.
+class Watchdog {
+ public:
+  typedef std::function<void(const SlowDispatch&)> Callback;
+  /// @brief How many of the latest incidents are kept.
+  static constexpr std::size_t kMaxIncidents = 64;
+
+ private:
+  struct Watched {
+    std::weak_ptr<Looper> looper;
+    const Looper* key;
+    std::string name;
+    // The dispatch last flagged, so that it is only flagged once.
+    std::uint64_t flagged;
+  };
+
+  const std::chrono::nanoseconds budget_;
+  const std::chrono::nanoseconds interval_;
+  std::mutex mutex_;
+  std::condition_variable conditionVariable_;
+  bool isStopping_;
+  std::vector<Watched> watched_;
+  std::deque<SlowDispatch> incidents_;
+  std::uint64_t incidentCount_;
+  Callback callback_;
+  std::thread thread_;
+
+  void threadFunction();
+  // Flags the looper's current dispatch if it has overrun the budget.
+  bool check(Watched* watched, SlowDispatch* incident);
+
+ public:
+  /// @param interval How often to check the loopers; zero for a quarter of
+  /// the budget.  A dispatch is flagged at most this long after it overruns.
+  explicit Watchdog(std::chrono::nanoseconds budget,
+      std::chrono::nanoseconds interval = std::chrono::nanoseconds::zero());
+  Watchdog(const Watchdog&) = delete;
+  Watchdog& operator=(const Watchdog&) = delete;
+  ~Watchdog();
+
+  /// @brief Starts watching the looper, which may already be running; the
+  /// watchdog stops on its own once the looper is destroyed.
+  void watch(Looper* looper, const std::string& name);
+  void watch(HandlerThread* thread);
+  void unwatch(Looper* looper);
+
+  /// @brief Invoked on the watchdog's thread for each incident.
+  void setCallback(Callback callback);
+  /// @brief The latest incidents, oldest first.
+  std::vector<SlowDispatch> incidents();
+  /// @brief How many incidents there have been, including any no longer
+  /// kept.
+  std::uint64_t incidentCount();
+  /// @brief Writes the watched loopers and the latest incidents, one per
+  /// line.
+  void dumpReport(std::ostream& os);
+};
+
+}  // namespace nx
+
+#endif  // INCLUDE_NX_WATCHDOG_H_
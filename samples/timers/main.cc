@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file main.cc
+/// @brief Benchmarks scheduling and cancelling a million outstanding delayed
+/// messages, with and without the Looper's timing wheel.
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "nx/application.h"
+#include "nx/looper.h"
+#include "nx/handler.h"
+
+namespace {
+
+const unsigned int kTimerCount = 1000000;
+
+double elapsedMilliseconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+// Schedules kTimerCount timeouts between 10ms and 30s, then cancels them all,
+// which is how nearly all timeouts end in practice.
+void run(const char* label, const nx::LooperOptions& options,
+    const std::vector<std::chrono::milliseconds>& delays) {
+  nx::HandlerThread thread(label, options);
+  nx::Handler handler(thread.getLooper());
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < kTimerCount; ++i) {
+    handler.sendEmptyMessage(i, delays[i]);
+  }
+  double scheduled = elapsedMilliseconds(start);
+
+  start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < kTimerCount; ++i) {
+    handler.removeMessages(i);
+  }
+  double cancelled = elapsedMilliseconds(start);
+
+  std::cout << label << ": schedule " << scheduled << " ms ("
+      << scheduled * 1e6 / kTimerCount << " ns/timer), cancel "
+      << cancelled << " ms (" << cancelled * 1e6 / kTimerCount
+      << " ns/timer)" << std::endl;
+}
+
+}  // namespace
+
+/// @brief The class for the timers application.
+class TimersApplication : public nx::Application {
+ public:
+  int main() {
+    std::mt19937 random(12345);
+    std::uniform_int_distribution<int> distribution(10, 30000);
+    std::vector<std::chrono::milliseconds> delays;
+    delays.reserve(kTimerCount);
+    for (unsigned int i = 0; i < kTimerCount; ++i) {
+      delays.emplace_back(distribution(random));
+    }
+
+    nx::LooperOptions heapOptions;
+    run("heap", heapOptions, delays);
+
+    nx::LooperOptions wheelOptions;
+    wheelOptions.timingWheel = true;
+    run("wheel", wheelOptions, delays);
+    return 0;
+  }
+};
+
+/// @brief Function to lazy-load the application; required by nx_main.cc
+nx::Application& nx::GetApplication() {
+  static TimersApplication app;
+  return app;
+}
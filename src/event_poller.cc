@@ -0,0 +1,203 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file event_poller.cc
+/// @brief Implementation for event_poller.h
+
+#include "nx/event_poller.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "nx/looper.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace detail {
+
+namespace Looper {
+
+#if defined(__linux__)
+
+namespace {
+
+std::uint32_t toEpoll(unsigned int events) {
+  std::uint32_t result = 0;
+  if (events & nx::Looper::kEventInput) result |= EPOLLIN;
+  if (events & nx::Looper::kEventOutput) result |= EPOLLOUT;
+  return result;
+}
+unsigned int fromEpoll(std::uint32_t events) {
+  unsigned int result = 0;
+  if (events & EPOLLIN) result |= nx::Looper::kEventInput;
+  if (events & EPOLLOUT) result |= nx::Looper::kEventOutput;
+  if (events & EPOLLERR) result |= nx::Looper::kEventError;
+  if (events & EPOLLHUP) result |= nx::Looper::kEventHangup;
+  return result;
+}
+void throwErrno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+bool watch(int epollFd, int operation, int fd, std::uint32_t events) {
+  epoll_event event = epoll_event();
+  event.events = events;
+  event.data.fd = fd;
+  return epoll_ctl(epollFd, operation, fd, &event) == 0;
+}
+
+}  // namespace
+
+bool EventPoller::supported() {
+  return true;
+}
+EventPoller::EventPoller()
+    : epollFd_(-1)
+    , wakeFd_(-1)
+    , timerFd_(-1)
+    , armed_(SteadyTimePoint::max()) {
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ == -1) {
+    throwErrno("epoll_create1");
+  }
+  wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  // steady_clock is CLOCK_MONOTONIC on linux, so deadlines carry over as is
+  timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (wakeFd_ == -1 || timerFd_ == -1
+      || !watch(epollFd_, EPOLL_CTL_ADD, wakeFd_, EPOLLIN)
+      || !watch(epollFd_, EPOLL_CTL_ADD, timerFd_, EPOLLIN)) {
+    int error = errno;
+    closeDescriptors();
+    errno = error;
+    throwErrno("EventPoller");
+  }
+}
+EventPoller::~EventPoller() {
+  closeDescriptors();
+}
+void EventPoller::closeDescriptors() {
+  for (int* fd : {&timerFd_, &wakeFd_, &epollFd_}) {
+    if (*fd != -1) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+void EventPoller::wake() {
+  std::uint64_t one = 1;
+  // A full counter still leaves the eventfd readable, so failure is benign.
+  ssize_t result = write(wakeFd_, &one, sizeof(one));
+  static_cast<void>(result);
+}
+bool EventPoller::add(int fd, unsigned int events) {
+  return watch(epollFd_, EPOLL_CTL_ADD, fd, toEpoll(events))
+      || (errno == EEXIST
+          && watch(epollFd_, EPOLL_CTL_MOD, fd, toEpoll(events)));
+}
+bool EventPoller::remove(int fd) {
+  return epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr) == 0;
+}
+void EventPoller::arm(SteadyTimePoint deadline) {
+  if (deadline == armed_) {
+    return;
+  }
+  itimerspec spec = itimerspec();
+  if (deadline != SteadyTimePoint::max()) {
+    auto since = deadline.time_since_epoch();
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since);
+    spec.it_value.tv_sec = static_cast<time_t>(seconds.count());
+    spec.it_value.tv_nsec = static_cast<long>(  // NOLINT(runtime/int)
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            since - seconds).count());
+    if (spec.it_value.tv_sec <= 0 && spec.it_value.tv_nsec <= 0) {
+      // zero would disarm it
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  // an all zero value disarms the timer
+  timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+  armed_ = deadline;
+}
+void EventPoller::wait(SteadyTimePoint deadline, ReadyList* ready) {
+  static const int kMaxEvents = 64;
+  epoll_event events[kMaxEvents];
+  int timeout = -1;
+  if (deadline <= std::chrono::steady_clock::now()) {
+    timeout = 0;
+  } else {
+    arm(deadline);
+  }
+  int count = epoll_wait(epollFd_, events, kMaxEvents, timeout);
+  for (int i = 0; i < count; ++i) {
+    const int fd = events[i].data.fd;
+    if (fd == wakeFd_ || fd == timerFd_) {
+      std::uint64_t value;
+      ssize_t result = read(fd, &value, sizeof(value));
+      static_cast<void>(result);
+      if (fd == timerFd_) {
+        armed_ = SteadyTimePoint::max();
+      }
+    } else {
+      ready->emplace_back(fd, fromEpoll(events[i].events));
+    }
+  }
+}
+
+#else  // !defined(__linux__)
+
+bool EventPoller::supported() {
+  return false;
+}
+EventPoller::EventPoller()
+    : epollFd_(-1)
+    , wakeFd_(-1)
+    , timerFd_(-1)
+    , armed_(SteadyTimePoint::max()) {
+  throw std::system_error(std::make_error_code(std::errc::not_supported),
+      "EventPoller");
+}
+EventPoller::~EventPoller() {
+}
+void EventPoller::closeDescriptors() {
+}
+void EventPoller::wake() {
+}
+bool EventPoller::add(int fd, unsigned int events) {
+  return false;
+}
+bool EventPoller::remove(int fd) {
+  return false;
+}
+void EventPoller::arm(SteadyTimePoint deadline) {
+}
+void EventPoller::wait(SteadyTimePoint deadline, ReadyList* ready) {
+}
+
+#endif  // defined(__linux__)
+
+}  // namespace Looper
+
+}  // namespace detail
+
+}  // namespace nx
@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file future.cc
+/// @brief Implementation for future.h
+
+#include "nx/future.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace detail {
+
+namespace Looper {
+
+CallStateBase::CallStateBase()
+    : status_(kPending)
+    , continuationLooper_(nullptr) {
+}
+CallStateBase::Status CallStateBase::status() const {
+  return static_cast<Status>(status_.load(std::memory_order_acquire));
+}
+void CallStateBase::settle(Status status) {
+  nx::Looper* looper;
+  MessagePayload continuation;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    status_.store(status, std::memory_order_release);
+    conditionVariable_.notify_all();
+    looper = continuationLooper_;
+    continuation = std::move(continuation_);
+  }
+  // The continuation holds the future, so once it is posted this state may
+  // be recycled at any moment.
+  if (looper) {
+    looper->postCallback(&continuation);
+  }
+}
+void CallStateBase::wait() {
+  if (status() != kPending) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  conditionVariable_.wait(lock, [this]() { return status() != kPending; });
+}
+void CallStateBase::abandon() {
+  if (status() == kPending) {
+    settle(kAbandoned);
+  }
+}
+bool CallStateBase::setContinuation(nx::Looper* looper,
+    MessagePayload* continuation) {
+  if (!looper) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (status() == kPending) {
+      continuationLooper_ = looper;
+      continuation_ = std::move(*continuation);
+      return looper->isAlive();
+    }
+  }
+  return looper->postCallback(continuation);
+}
+
+}  // namespace Looper
+
+}  // namespace detail
+
+}  // namespace nx
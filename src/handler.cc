@@ -18,6 +18,11 @@
 /// @brief Implementation for handler.h
 
 #include "nx/handler.h"
+
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+
 #include "nx/looper.h"
 
 /// @brief Library namespace.
@@ -33,14 +38,28 @@ Handler::Handler(Looper*looper)
     : Handler(looper, NULL) {
 }
 Handler::Handler(Looper* looper, Callback* callback)
-    : looper_(looper), callback_(callback) {
+    : looper_(looper), callback_(callback)
+    , looperReference_(looper ? looper->shared_from_this()
+        : std::shared_ptr<Looper>())
+    , nextCallbackToken_(0) {
   if (!looper) {
     throw std::runtime_error("Looper specified is nullptr.  Did you call"
         " Looper::prepare()?");
   }
 }
+Handler::~Handler() {
+  // The looper goes away when its thread exits, which may have happened
+  // already.
+  if (std::shared_ptr<Looper> looper = looperReference_.lock()) {
+    looper->removeAllMessages(this);
+  }
+}
 
 void Handler::dispatchMessage(Message message) {
+  if (message.callback_) {
+    message.payload_->invoke();
+    return;
+  }
   if (callback_) {
     if (callback_->handleMessage(message)) {
       return;
@@ -72,9 +91,102 @@ bool Handler::sendMessage(
   return looper_->send(MessageEnvelope(this, message), triggerTime);
 }
 
-bool Handler::sendMessage(
-    Message message, std::chrono::milliseconds delay) {
-  return looper_->send(MessageEnvelope(this, message), delay);
+bool Handler::sendMessage(Message message) {
+  return looper_->send(MessageEnvelope(this, message), ClockDuration::zero());
+}
+
+bool Handler::sendMessage(Message message, MessagePayload payload) {
+  return looper_->send(MessageEnvelope(this, message), ClockDuration::zero(),
+      &payload);
+}
+
+bool Handler::sendMessage(Message message, MessagePayload payload,
+    Handler::SteadyTimePoint triggerTime) {
+  return looper_->send(MessageEnvelope(this, message), triggerTime, &payload);
+}
+
+bool Handler::sendMessageIfAbsent(Message message) {
+  return looper_->sendIfAbsent(MessageEnvelope(this, message),
+      std::chrono::steady_clock::now());
+}
+
+bool Handler::sendMessageIfAbsent(Message message,
+    Handler::SteadyTimePoint triggerTime) {
+  return looper_->sendIfAbsent(MessageEnvelope(this, message), triggerTime);
+}
+
+bool Handler::sendMessageIfAbsent(Message message, MessagePayload payload,
+    Handler::SteadyTimePoint triggerTime) {
+  return looper_->sendIfAbsent(MessageEnvelope(this, message), triggerTime,
+      &payload);
+}
+
+bool Handler::sendPeriodic(Message message, Handler::SteadyTimePoint first,
+    ClockDuration period, PeriodicPolicy policy, MissedTicks missedTicks) {
+  return looper_->sendPeriodic(MessageEnvelope(this, message), first, period,
+      policy, missedTicks);
+}
+
+bool Handler::sendPeriodic(Message message, MessagePayload payload,
+    Handler::SteadyTimePoint first, ClockDuration period,
+    PeriodicPolicy policy, MissedTicks missedTicks) {
+  return looper_->sendPeriodic(MessageEnvelope(this, message), first, period,
+      policy, missedTicks, &payload);
+}
+
+bool Handler::replaceMessage(Message message,
+    Handler::SteadyTimePoint triggerTime, ReplaceDeadline deadline) {
+  return looper_->replace(MessageEnvelope(this, message), triggerTime,
+      nullptr, deadline);
+}
+
+bool Handler::replaceMessage(Message message, MessagePayload payload,
+    Handler::SteadyTimePoint triggerTime, ReplaceDeadline deadline) {
+  return looper_->replace(MessageEnvelope(this, message), triggerTime,
+      &payload, deadline);
+}
+
+bool Handler::sendDelayed(Message message, ClockDuration delay,
+    MessagePayload* payload) {
+  return looper_->send(MessageEnvelope(this, message), delay, payload);
+}
+
+Message Handler::callbackMessage() {
+  // 0 is never a valid token
+  unsigned int token;
+  do {
+    token = nextCallbackToken_.fetch_add(1, std::memory_order_relaxed) + 1;
+  } while (token == 0);
+  Message message(token);
+  message.callback_ = true;
+  return message;
+}
+
+unsigned int Handler::postCallback(MessagePayload* payload,
+    ClockDuration delay) {
+  Message message = callbackMessage();
+  return looper_->send(MessageEnvelope(this, message), delay, payload)
+      ? message.id() : 0;
+}
+
+unsigned int Handler::postCallback(MessagePayload* payload,
+    Handler::SteadyTimePoint triggerTime) {
+  Message message = callbackMessage();
+  return looper_->send(MessageEnvelope(this, message), triggerTime, payload)
+      ? message.id() : 0;
+}
+
+bool Handler::sendCall(MessagePayload* payload, detail::Looper::Node* node) {
+  return looper_->sendNow(MessageEnvelope(this, callbackMessage()), payload,
+      node);
+}
+
+bool Handler::removeCallbacks(unsigned int token) {
+  return looper_->removeCallback(this, token);
+}
+
+bool Handler::hasCallbacks(unsigned int token) const {
+  return looper_->hasCallback(this, token);
 }
 
 bool Handler::sendEmptyMessage(
@@ -82,9 +194,8 @@ bool Handler::sendEmptyMessage(
   return looper_->send(MessageEnvelope(this, Message(id)), triggerTime);
 }
 
-bool Handler::sendEmptyMessage(
-    unsigned int id, std::chrono::milliseconds delay) {
-  return looper_->send(MessageEnvelope(this, Message(id)), delay);
+bool Handler::sendEmptyMessage(unsigned int id) {
+  return sendMessage(Message(id));
 }
 
 void Handler::removeMessages(unsigned int id) {
@@ -93,6 +204,9 @@ void Handler::removeMessages(unsigned int id) {
 void Handler::removeMessages(unsigned int id, void* data) {
   looper_->remove(this, id, true, data);
 }
+void Handler::removeCallbacksAndMessages() {
+  looper_->removeAllMessages(this);
+}
 
 void Handler::handleMessage(Message message) {
 }
@@ -101,19 +215,54 @@ void Handler::handleMessage(Message message) {
 // HandlerThread
 
 void HandlerThread::threadFunction() {
-  Looper::prepare();
+  ThreadOptions threadOptions(threadOptions_);
+  if (threadOptions.name.empty()) {
+    threadOptions.name = name_;
+  }
+  std::error_code error =
+      detail::NativeThread::applyToCurrentThread(threadOptions);
+  if (!error) {
+    Tracer::setThreadName(name_);
+    try {
+      Looper::prepare(options_);
+    } catch (const std::invalid_argument&) {
+      error = std::make_error_code(std::errc::invalid_argument);
+    }
+  }
   { // arbitrary block
     std::lock_guard<std::mutex> lock(mutex_);
-    looper_ = Looper::threadLooper();
+    started_ = true;
+    startError_ = error;
+    if (!error) {
+      looper_ = Looper::threadLooper();
+    }
     conditionVariable_.notify_all();
   }
+  if (error) {
+    return;
+  }
   Looper::loop();
 }
 
-HandlerThread::HandlerThread(const std::string& name)
+HandlerThread::HandlerThread(const std::string& name,
+    const LooperOptions& options, const ThreadOptions& threadOptions)
     : name_(name)
-    , looper_(nullptr) {
-  threadObject_.reset(new std::thread(&HandlerThread::threadFunction, this));
+    , options_(options)
+    , threadOptions_(threadOptions)
+    , looper_(nullptr)
+    , started_(false) {
+  threadObject_.reset(new detail::NativeThread(
+      std::bind(&HandlerThread::threadFunction, this),
+      threadOptions_.stackSize));
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!started_) {
+    conditionVariable_.wait(lock);
+  }
+  if (startError_) {
+    lock.unlock();
+    threadObject_->join();
+    throw std::system_error(startError_, "HandlerThread " + name_);
+  }
 }
 HandlerThread::~HandlerThread() {
   getLooper()->quit();
@@ -134,6 +283,12 @@ Looper* HandlerThread::getLooper() {
   looper_->waitForLoop();
   return looper_.get();
 }
+const std::string& HandlerThread::getName() const {
+  return name_;
+}
+ThreadSettings HandlerThread::threadSettings() const {
+  return threadObject_->settings();
+}
 
 void HandlerThread::join() {
   return threadObject_->join();
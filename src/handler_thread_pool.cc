@@ -0,0 +1,257 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file handler_thread_pool.cc
+/// @brief Implementation for handler_thread_pool.h
+
+#include "nx/handler_thread_pool.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace {
+
+// The pool, and the index within it, of the current thread if it is a
+// pool thread.
+thread_local HandlerThreadPool* currentPool = nullptr;
+thread_local std::size_t currentWorker = 0;
+
+// How many messages a strand runs before letting other work have a turn.
+const std::size_t kStrandBudget = 64;
+
+}  // namespace
+
+// PoolHandler
+
+PoolHandler::Strand::Strand()
+    : scheduled(false) {
+}
+
+PoolHandler::PoolHandler(HandlerThreadPool* pool, Ordering ordering,
+    std::size_t stripes)
+    : pool_(pool)
+    , ordering_(ordering)
+    , stripes_(ordering == Ordering::kUnordered ? 0
+        : (stripes ? stripes : 1)) {
+  if (stripes_) {
+    strands_.reset(new Strand[stripes_]);
+  }
+}
+PoolHandler::~PoolHandler() {
+  // A pool thread may still be finishing with a strand after running its
+  // last message.
+  for (std::size_t i = 0; i < stripes_; ++i) {
+    Strand& strand = strands_[i];
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> lock(strand.mutex);
+        if (!strand.scheduled || pool_->isQuitting_.load()) {
+          break;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+}
+HandlerThreadPool* PoolHandler::pool() {
+  return pool_;
+}
+bool PoolHandler::sendMessage(Message message) {
+  return sendMessage(message, 0);
+}
+bool PoolHandler::sendMessage(Message message, std::size_t key) {
+  if (ordering_ == Ordering::kUnordered) {
+    return pool_->submit(HandlerThreadPool::Task{this, message, nullptr});
+  }
+  Strand* strand = &strands_[key % stripes_];
+  {
+    std::lock_guard<std::mutex> lock(strand->mutex);
+    strand->messages.push_back(message);
+    if (strand->scheduled) {
+      // whoever scheduled it will get to this message
+      return true;
+    }
+    strand->scheduled = true;
+  }
+  return pool_->submit(HandlerThreadPool::Task{this, Message(), strand});
+}
+void PoolHandler::handleMessage(Message message) {
+}
+
+// HandlerThreadPool
+
+HandlerThreadPool::Worker::Worker()
+    : size(0) {
+}
+
+HandlerThreadPool::HandlerThreadPool(const std::string& name,
+    std::size_t threads)
+    : name_(name)
+    , isQuitting_(false)
+    , nextWorker_(0)
+    , sleepers_(0)
+    , steals_(0) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+    if (threads == 0) {
+      threads = 1;
+    }
+  }
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back(new Worker());
+  }
+  for (std::size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&HandlerThreadPool::threadFunction, this, i);
+  }
+}
+HandlerThreadPool::~HandlerThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex_);
+    isQuitting_.store(true);
+    conditionVariable_.notify_all();
+  }
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+std::size_t HandlerThreadPool::size() const {
+  return workers_.size();
+}
+std::uint64_t HandlerThreadPool::steals() const {
+  return steals_.load(std::memory_order_relaxed);
+}
+bool HandlerThreadPool::submit(const Task& task) {
+  if (isQuitting_.load()) {
+    return false;
+  }
+  // Pool threads keep what they send, which is then the first to be stolen
+  // if they stay busy.
+  const std::size_t index = currentPool == this ? currentWorker
+      : nextWorker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+  Worker& worker = *workers_[index];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.tasks.push_back(task);
+    worker.size.store(worker.tasks.size());
+  }
+  // Pairs with a thread counting itself in sleepers_ before checking the
+  // deques one last time; at least one side sees the other.
+  if (sleepers_.load() != 0) {
+    std::lock_guard<std::mutex> lock(sleepMutex_);
+    conditionVariable_.notify_one();
+  }
+  return true;
+}
+bool HandlerThreadPool::take(std::size_t index, Task* task) {
+  Worker& worker = *workers_[index];
+  if (worker.size.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  if (worker.tasks.empty()) {
+    return false;
+  }
+  *task = worker.tasks.front();
+  worker.tasks.pop_front();
+  worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+  return true;
+}
+bool HandlerThreadPool::steal(std::size_t index, Task* task) {
+  Worker& self = *workers_[index];
+  const std::size_t count = workers_.size();
+  for (std::size_t offset = 1; offset < count; ++offset) {
+    Worker& victim = *workers_[(index + offset) % count];
+    if (victim.size.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+    {
+      // take the newest half, leaving the victim the oldest
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      const std::size_t available = victim.tasks.size();
+      if (available == 0) {
+        continue;
+      }
+      const auto first = victim.tasks.end()
+          - static_cast<std::ptrdiff_t>((available + 1) / 2);
+      self.stolen.assign(first, victim.tasks.end());
+      victim.tasks.erase(first, victim.tasks.end());
+      victim.size.store(victim.tasks.size(), std::memory_order_relaxed);
+    }
+    steals_.fetch_add(1, std::memory_order_relaxed);
+    *task = self.stolen.front();
+    if (self.stolen.size() > 1) {
+      std::lock_guard<std::mutex> lock(self.mutex);
+      self.tasks.insert(self.tasks.end(), self.stolen.begin() + 1,
+          self.stolen.end());
+      self.size.store(self.tasks.size());
+    }
+    self.stolen.clear();
+    return true;
+  }
+  return false;
+}
+bool HandlerThreadPool::anyQueued() const {
+  for (const auto& worker : workers_) {
+    if (worker->size.load() != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+void HandlerThreadPool::run(const Task& task) {
+  if (task.strand) {
+    runStrand(task.handler, task.strand);
+  } else {
+    task.handler->handleMessage(task.message);
+  }
+}
+void HandlerThreadPool::runStrand(PoolHandler* handler,
+    PoolHandler::Strand* strand) {
+  for (std::size_t i = 0; i < kStrandBudget; ++i) {
+    Message message;
+    {
+      std::lock_guard<std::mutex> lock(strand->mutex);
+      if (strand->messages.empty()) {
+        strand->scheduled = false;
+        return;
+      }
+      message = strand->messages.front();
+      strand->messages.pop_front();
+    }
+    handler->handleMessage(message);
+  }
+  // still scheduled; requeue it behind whatever else is waiting
+  submit(Task{handler, Message(), strand});
+}
+void HandlerThreadPool::threadFunction(std::size_t index) {
+  currentPool = this;
+  currentWorker = index;
+  Task task;
+  while (!isQuitting_.load()) {
+    if (take(index, &task) || steal(index, &task)) {
+      run(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleepMutex_);
+    sleepers_.fetch_add(1);
+    if (!isQuitting_.load() && !anyQueued()) {
+      conditionVariable_.wait(lock);
+    }
+    sleepers_.fetch_sub(1);
+  }
+}
+
+}  // namespace nx
@@ -0,0 +1,394 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file io_ring.cc
+/// @brief Implementation for io_ring.h
+
+#include "nx/io_ring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "nx/handler.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+IoRequest::IoRequest()
+    : operation(Operation::kRead)
+    , fd(-1)
+    , offset(0)
+    , buffer(nullptr)
+    , length(0)
+    , bufferIndex(-1)
+    , handler(nullptr)
+    , messageId(0)
+    , result(0)
+    , userData(nullptr) {
+}
+
+unsigned int IoRing::inFlight() const {
+  return inFlight_.load();
+}
+std::uint64_t IoRing::lostCompletions() const {
+  return lostCompletions_.load(std::memory_order_relaxed);
+}
+bool IoRing::submit(IoRequest* request) {
+  return submit(&request, 1) == 1;
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+namespace {
+
+// There is no libc wrapper for these, and liburing is not a dependency.
+int setup(unsigned int entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+int enter(int fd, unsigned int toSubmit, unsigned int minComplete,
+    unsigned int flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit,
+      minComplete, flags, nullptr, 0));
+}
+int registerWith(int fd, unsigned int opcode, const void* arg,
+    unsigned int count) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// The ring indices are shared with the kernel.
+unsigned int loadAcquire(const unsigned int* value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+void storeRelease(unsigned int* value, unsigned int newValue) {
+  __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+T* offsetBy(void* base, std::uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+void throwErrno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+}  // namespace
+
+bool IoRing::supported() {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int fd = setup(1, &params);
+  if (fd == -1) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+IoRing::IoRing(Looper* looper, unsigned int entries)
+    : looper_(looper)
+    , ringFd_(-1)
+    , eventFd_(-1)
+    , sqRing_(MAP_FAILED)
+    , sqRingSize_(0)
+    , cqRing_(MAP_FAILED)
+    , cqRingSize_(0)
+    , sqes_(MAP_FAILED)
+    , sqesSize_(0)
+    , sqHead_(nullptr)
+    , sqTail_(nullptr)
+    , sqMask_(0)
+    , sqArray_(nullptr)
+    , cqHead_(nullptr)
+    , cqTail_(nullptr)
+    , cqMask_(0)
+    , cqes_(nullptr)
+    , cqEntries_(0)
+    , inFlight_(0)
+    , lostCompletions_(0) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ringFd_ = setup(entries, &params);
+  if (ringFd_ == -1) {
+    throwErrno("io_uring_setup");
+  }
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+  }
+  sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+  if (sqRing_ != MAP_FAILED) {
+    cqRing_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing_
+        : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+  }
+  sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+  if (cqRing_ != MAP_FAILED) {
+    sqes_ = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+  }
+  if (sqes_ == MAP_FAILED) {
+    int error = errno;
+    unmap();
+    close(ringFd_);
+    errno = error;
+    throwErrno("mmap");
+  }
+  sqHead_ = offsetBy<unsigned int>(sqRing_, params.sq_off.head);
+  sqTail_ = offsetBy<unsigned int>(sqRing_, params.sq_off.tail);
+  sqMask_ = *offsetBy<unsigned int>(sqRing_, params.sq_off.ring_mask);
+  sqArray_ = offsetBy<unsigned int>(sqRing_, params.sq_off.array);
+  cqHead_ = offsetBy<unsigned int>(cqRing_, params.cq_off.head);
+  cqTail_ = offsetBy<unsigned int>(cqRing_, params.cq_off.tail);
+  cqMask_ = *offsetBy<unsigned int>(cqRing_, params.cq_off.ring_mask);
+  cqes_ = offsetBy<io_uring_cqe>(cqRing_, params.cq_off.cqes);
+  cqEntries_ = params.cq_entries;
+
+  // Completions signal the eventfd, which the looper's epoll watches.
+  errno = 0;
+  eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (eventFd_ == -1
+      || registerWith(ringFd_, IORING_REGISTER_EVENTFD, &eventFd_, 1) != 0
+      || !looper_->addFd(eventFd_, Looper::kEventInput,
+          [this](int, unsigned int) {
+            reap();
+            return true;
+          })) {
+    // addFd() leaves errno alone when the looper has no event poller
+    int error = errno ? errno : ENOTSUP;
+    if (eventFd_ != -1) {
+      close(eventFd_);
+    }
+    unmap();
+    close(ringFd_);
+    errno = error;
+    throwErrno("IoRing");
+  }
+}
+IoRing::~IoRing() {
+  looper_->removeFd(eventFd_);
+  abandon();
+  unmap();
+  close(ringFd_);
+  close(eventFd_);
+}
+void IoRing::unmap() {
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqesSize_);
+  }
+  if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+    munmap(cqRing_, cqRingSize_);
+  }
+  if (sqRing_ != MAP_FAILED) {
+    munmap(sqRing_, sqRingSize_);
+  }
+}
+bool IoRing::registerBuffers(const std::vector<IoBuffer>& buffers) {
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  if (inFlight_.load() != 0) {
+    return false;
+  }
+  // unregistering fails harmlessly when nothing is registered
+  registerWith(ringFd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+  if (buffers.empty()) {
+    return true;
+  }
+  std::vector<iovec> vectors;
+  vectors.reserve(buffers.size());
+  for (const IoBuffer& buffer : buffers) {
+    vectors.push_back(iovec{buffer.data, buffer.size});
+  }
+  return registerWith(ringFd_, IORING_REGISTER_BUFFERS, vectors.data(),
+      static_cast<unsigned int>(vectors.size())) == 0;
+}
+std::size_t IoRing::queue(IoRequest* const* requests, std::size_t count) {
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  return place(requests, count);
+}
+std::size_t IoRing::submit(IoRequest* const* requests, std::size_t count) {
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  count = place(requests, count);
+  const unsigned int tail = *sqTail_;
+  const unsigned int pending = tail - loadAcquire(sqHead_);
+  if (pending == 0) {
+    return count;
+  }
+  // Anything the kernel doesn't take now, say on EBUSY, stays in the ring and
+  // goes with the next submission, or is flushed by abandon().
+  if (enter(ringFd_, pending, 0, 0) != -1 || errno == EBUSY
+      || errno == EAGAIN || errno == EINTR) {
+    return count;
+  }
+  // The kernel took none of them and won't later, so this call's requests
+  // are taken back out; any queued before them are left for another try.
+  const unsigned int untaken =
+      std::min(static_cast<unsigned int>(count), pending);
+  storeRelease(sqTail_, tail - untaken);
+  inFlight_.fetch_sub(untaken);
+  return count - untaken;
+}
+std::size_t IoRing::place(IoRequest* const* requests, std::size_t count) {
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(sqes_);
+  // only this thread advances the tail; the kernel advances the head
+  unsigned int tail = *sqTail_;
+  const unsigned int head = loadAcquire(sqHead_);
+  std::size_t room = sqMask_ + 1 - (tail - head);
+  const unsigned int inFlight = inFlight_.load();
+  if (cqEntries_ - inFlight < room) {
+    room = cqEntries_ - inFlight;
+  }
+  if (count > room) {
+    count = room;
+  }
+  for (std::size_t i = 0; i < count; ++i) {
+    const IoRequest* request = requests[i];
+    const unsigned int index = tail & sqMask_;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    const bool fixed = request->bufferIndex >= 0;
+    if (request->operation == IoRequest::Operation::kRead) {
+      sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    } else {
+      sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    }
+    sqe->fd = request->fd;
+    sqe->off = request->offset;
+    sqe->addr = reinterpret_cast<std::uintptr_t>(request->buffer);
+    sqe->len = static_cast<std::uint32_t>(request->length);
+    if (fixed) {
+      sqe->buf_index = static_cast<std::uint16_t>(request->bufferIndex);
+    }
+    sqe->user_data = reinterpret_cast<std::uintptr_t>(request);
+    sqArray_[index] = index;
+    ++tail;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  inFlight_.fetch_add(static_cast<unsigned int>(count));
+  storeRelease(sqTail_, tail);
+  return count;
+}
+void IoRing::reap() {
+  std::uint64_t value;
+  ssize_t result = read(eventFd_, &value, sizeof(value));
+  static_cast<void>(result);
+  // Pairs with submit() to make the requests' contents visible here, as the
+  // kernel handing back user_data is not a synchronization C++ knows about.
+  if (inFlight_.load(std::memory_order_acquire) == 0) {
+    return;
+  }
+  const io_uring_cqe* cqes = static_cast<const io_uring_cqe*>(cqes_);
+  unsigned int head = *cqHead_;
+  while (head != loadAcquire(cqTail_)) {
+    const io_uring_cqe& cqe = cqes[head & cqMask_];
+    IoRequest* request =
+        reinterpret_cast<IoRequest*>(static_cast<std::uintptr_t>(
+            cqe.user_data));
+    request->result = cqe.res;
+    // hand the slot back first, so the handler may submit again right away
+    storeRelease(cqHead_, ++head);
+    inFlight_.fetch_sub(1);
+    if (request->handler
+        && !request->handler->sendMessage(
+            Message(request->messageId, request))) {
+      lostCompletions_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+void IoRing::abandon() {
+  while (inFlight_.load() != 0) {
+    unsigned int head = *cqHead_;
+    const unsigned int tail = loadAcquire(cqTail_);
+    if (head == tail) {
+      // requests that were queued but never submitted would never complete
+      if (enter(ringFd_, *sqTail_ - loadAcquire(sqHead_), 1,
+          IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    inFlight_.fetch_sub(tail - head);
+    storeRelease(cqHead_, tail);
+  }
+}
+
+#else  // !defined(__linux__) || !defined(__NR_io_uring_setup)
+
+bool IoRing::supported() {
+  return false;
+}
+IoRing::IoRing(Looper* looper, unsigned int entries)
+    : looper_(looper)
+    , ringFd_(-1)
+    , eventFd_(-1)
+    , sqRing_(nullptr)
+    , sqRingSize_(0)
+    , cqRing_(nullptr)
+    , cqRingSize_(0)
+    , sqes_(nullptr)
+    , sqesSize_(0)
+    , sqHead_(nullptr)
+    , sqTail_(nullptr)
+    , sqMask_(0)
+    , sqArray_(nullptr)
+    , cqHead_(nullptr)
+    , cqTail_(nullptr)
+    , cqMask_(0)
+    , cqes_(nullptr)
+    , cqEntries_(0)
+    , inFlight_(0)
+    , lostCompletions_(0) {
+  throw std::system_error(std::make_error_code(std::errc::not_supported),
+      "IoRing");
+}
+IoRing::~IoRing() {
+}
+void IoRing::unmap() {
+}
+bool IoRing::registerBuffers(const std::vector<IoBuffer>& buffers) {
+  return false;
+}
+std::size_t IoRing::queue(IoRequest* const* requests, std::size_t count) {
+  return 0;
+}
+std::size_t IoRing::submit(IoRequest* const* requests, std::size_t count) {
+  return 0;
+}
+std::size_t IoRing::place(IoRequest* const* requests, std::size_t count) {
+  return 0;
+}
+void IoRing::reap() {
+}
+void IoRing::abandon() {
+}
+
+#endif  // defined(__linux__) && defined(__NR_io_uring_setup)
+
+}  // namespace nx
@@ -0,0 +1,186 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file latency_histogram.cc
+/// @brief Implementation for latency_histogram.h
+
+#include "nx/latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace {
+
+// The index of the highest set bit; value must be nonzero.
+unsigned int highestBit(std::uint64_t value) {
+#if defined(__GNUC__)
+  return 63u - static_cast<unsigned int>(__builtin_clzll(value));
+#else
+  unsigned int bit = 0;
+  while (value >>= 1) {
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram()
+    : count(0)
+    , total(0)
+    , max(0) {
+  buckets.fill(0);
+}
+std::size_t LatencyHistogram::bucketOf(std::uint64_t nanoseconds) {
+  if (nanoseconds < kSubBuckets) {
+    return static_cast<std::size_t>(nanoseconds);
+  }
+  const unsigned int exponent = highestBit(nanoseconds);
+  const std::size_t bucket = (exponent - kSubBucketBits + 1) * kSubBuckets
+      + static_cast<std::size_t>(
+          (nanoseconds >> (exponent - kSubBucketBits)) - kSubBuckets);
+  return std::min(bucket, kBuckets - 1);
+}
+std::uint64_t LatencyHistogram::lowerBound(std::size_t bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  const std::size_t exponent = bucket / kSubBuckets + kSubBucketBits - 1;
+  return static_cast<std::uint64_t>(kSubBuckets + bucket % kSubBuckets)
+      << (exponent - kSubBucketBits);
+}
+std::chrono::nanoseconds LatencyHistogram::percentile(double q) const {
+  if (count == 0) {
+    return std::chrono::nanoseconds::zero();
+  }
+  const double clamped = std::min(std::max(q, 0.0), 1.0);
+  const std::uint64_t rank = std::max<std::uint64_t>(1,
+      static_cast<std::uint64_t>(std::ceil(clamped
+          * static_cast<double>(count))));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i + 1 < kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return std::chrono::nanoseconds(static_cast<std::int64_t>(
+          std::min(lowerBound(i + 1) - 1, max)));
+    }
+  }
+  return std::chrono::nanoseconds(static_cast<std::int64_t>(max));
+}
+
+LooperLatencyStatistics::LooperLatencyStatistics()
+    : enabled(false) {
+}
+
+#ifdef NX_LOOPER_LATENCY
+
+namespace detail {
+
+namespace Looper {
+
+LatencyCounters::LatencyCounters()
+    : count_(0)
+    , total_(0)
+    , max_(0) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+void LatencyCounters::record(std::uint64_t nanoseconds) {
+  const auto bump = [](std::atomic<std::uint64_t>* counter,
+      std::uint64_t amount) {
+    counter->store(counter->load(std::memory_order_relaxed) + amount,
+        std::memory_order_relaxed);
+  };
+  bump(&count_, 1);
+  bump(&total_, nanoseconds);
+  if (nanoseconds > max_.load(std::memory_order_relaxed)) {
+    max_.store(nanoseconds, std::memory_order_relaxed);
+  }
+  bump(&buckets_[LatencyHistogram::bucketOf(nanoseconds)], 1);
+}
+void LatencyCounters::snapshot(LatencyHistogram* histogram) const {
+  histogram->count = count_.load(std::memory_order_relaxed);
+  histogram->total = total_.load(std::memory_order_relaxed);
+  histogram->max = max_.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i < buckets_.size(); ++i) {
+    histogram->buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+}
+
+void LatencyRecorder::Counters::record(std::uint64_t queueDelay,
+    std::uint64_t execution) {
+  this->queueDelay.record(queueDelay);
+  this->execution.record(execution);
+}
+void LatencyRecorder::Counters::snapshot(MessageLatency* latency) const {
+  queueDelay.snapshot(&latency->queueDelay);
+  execution.snapshot(&latency->execution);
+}
+
+LatencyRecorder::LatencyRecorder()
+    : tracked_(0) {
+  for (auto& id : ids_) {
+    id.store(0, std::memory_order_relaxed);
+  }
+  slots_.reserve(kTrackedIds);
+}
+void LatencyRecorder::record(bool isCallback, unsigned int id,
+    std::chrono::nanoseconds queueDelay, std::chrono::nanoseconds execution) {
+  const std::uint64_t delay = static_cast<std::uint64_t>(
+      std::max(queueDelay.count(), std::int64_t(0)));
+  const std::uint64_t took = static_cast<std::uint64_t>(
+      std::max(execution.count(), std::int64_t(0)));
+  all_.record(delay, took);
+  if (isCallback) {
+    return;
+  }
+  auto it = slots_.find(id);
+  if (it == slots_.end()) {
+    const std::size_t slot = tracked_.load(std::memory_order_relaxed);
+    if (slot == kTrackedIds) {
+      return;
+    }
+    ids_[slot].store(id, std::memory_order_relaxed);
+    tracked_.store(slot + 1, std::memory_order_release);
+    it = slots_.emplace(id, slot).first;
+  }
+  byId_[it->second].record(delay, took);
+}
+LooperLatencyStatistics LatencyRecorder::snapshot() const {
+  LooperLatencyStatistics statistics;
+  statistics.enabled = true;
+  all_.snapshot(&statistics.all);
+  const std::size_t tracked = tracked_.load(std::memory_order_acquire);
+  statistics.byId.resize(tracked);
+  for (std::size_t i = 0; i < tracked; ++i) {
+    statistics.byId[i].first = ids_[i].load(std::memory_order_relaxed);
+    byId_[i].snapshot(&statistics.byId[i].second);
+  }
+  return statistics;
+}
+
+}  // namespace Looper
+
+}  // namespace detail
+
+#endif  // NX_LOOPER_LATENCY
+
+}  // namespace nx
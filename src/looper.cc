@@ -18,6 +18,9 @@
 /// @brief Implementation for looper.h
 
 #include "nx/looper.h"
+
+#include <algorithm>
+
 #include "nx/handler.h"
 
 /// @brief Library namespace.
@@ -35,32 +38,189 @@ const Message* MessageEnvelope::message() const {
   return &message_;
 }
 
+
+IdleHandler::~IdleHandler() {
+}
+
+PressureListener::~PressureListener() {
+}
+
+LooperOptions::LooperOptions()
+    : timingWheel(false)
+    , timingWheelTick(std::chrono::milliseconds(1))
+    , dispatchBatchLimit(1)
+    , highResolution(false)
+    , spinWindow(std::chrono::microseconds(200))
+    , eventPoller(false)
+    , priorityLanes(1)
+    , laneSelection(LaneSelection::kStrict)
+    , latencyHistograms(false)
+    , capacity(0)
+    , overflowPolicy(OverflowPolicy::kFailFast)
+    , sendTimeout(std::chrono::nanoseconds::max())
+    , highWaterMark(0)
+    , lowWaterMark(0) {
+}
+
+LooperBatchStatistics::LooperBatchStatistics()
+    : batches(0)
+    , messages(0)
+    , largest(0) {
+  histogram.fill(0);
+}
+
+LooperAllocationStatistics::LooperAllocationStatistics()
+    : nodes(0)
+    , payloadBlocks(0) {
+}
+
+LooperQueueStatistics::LooperQueueStatistics()
+    : depth(0)
+    , capacity(0)
+    , rejected(0)
+    , dropped(0) {
+}
+
 namespace detail {
 
 namespace Looper {
 
-QueueData::QueueData(MessageEnvelope envelope)
-  : envelope_(envelope) {
+BatchCounters::BatchCounters()
+    : batches_(0)
+    , messages_(0)
+    , largest_(0) {
+  for (auto& bucket : histogram_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+void BatchCounters::record(std::size_t size) {
+  const auto bump = [](std::atomic<std::uint64_t>* counter,
+      std::uint64_t amount) {
+    counter->store(counter->load(std::memory_order_relaxed) + amount,
+        std::memory_order_relaxed);
+  };
+  bump(&batches_, 1);
+  bump(&messages_, size);
+  if (size > largest_.load(std::memory_order_relaxed)) {
+    largest_.store(size, std::memory_order_relaxed);
+  }
+  std::size_t bucket = 0;
+  for (std::size_t rest = size >> 1; rest && bucket + 1 < histogram_.size();
+      rest >>= 1) {
+    ++bucket;
+  }
+  bump(&histogram_[bucket], 1);
+}
+LooperBatchStatistics BatchCounters::snapshot() const {
+  LooperBatchStatistics statistics;
+  statistics.batches = batches_.load(std::memory_order_relaxed);
+  statistics.messages = messages_.load(std::memory_order_relaxed);
+  statistics.largest = largest_.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i < histogram_.size(); ++i) {
+    statistics.histogram[i] = histogram_[i].load(std::memory_order_relaxed);
+  }
+  return statistics;
+}
+
+DispatchBeacon::DispatchBeacon()
+    : sequence_(0)
+    , active_(false)
+    , handler_(nullptr)
+    , id_(0)
+    , isCallback_(false)
+    , start_(0) {
+}
+void DispatchBeacon::publish(bool active, const Handler* handler,
+    unsigned int id, bool isCallback, SteadyTimePoint start) {
+  const std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+  sequence_.store(sequence + 1, std::memory_order_relaxed);
+  // Releasing each field orders it after the odd sequence, for readers that
+  // acquire it.
+  active_.store(active, std::memory_order_release);
+  handler_.store(handler, std::memory_order_release);
+  id_.store(id, std::memory_order_release);
+  isCallback_.store(isCallback, std::memory_order_release);
+  start_.store(start.time_since_epoch().count(), std::memory_order_release);
+  sequence_.store(sequence + 2, std::memory_order_release);
+}
+void DispatchBeacon::begin(const Handler* handler, unsigned int id,
+    bool isCallback, SteadyTimePoint start) {
+  publish(true, handler, id, isCallback, start);
+}
+void DispatchBeacon::end() {
+  publish(false, nullptr, 0, false, SteadyTimePoint());
+}
+bool DispatchBeacon::read(Dispatch* dispatch) const {
+  const std::uint64_t before = sequence_.load(std::memory_order_acquire);
+  if (before % 2) {
+    return false;
+  }
+  const bool active = active_.load(std::memory_order_acquire);
+  dispatch->handler = handler_.load(std::memory_order_acquire);
+  dispatch->id = id_.load(std::memory_order_acquire);
+  dispatch->isCallback = isCallback_.load(std::memory_order_acquire);
+  dispatch->start = SteadyTimePoint(SteadyTimePoint::duration(
+      start_.load(std::memory_order_acquire)));
+  dispatch->sequence = before;
+  return active && sequence_.load(std::memory_order_relaxed) == before;
 }
 
 }  // namespace Looper
 
 }  // namespace detail
 
-
 thread_local std::shared_ptr<Looper> Looper::looper_;
-Looper::Looper()
+Looper::Looper(const LooperOptions& options)
     : hasLooped_(false)
-    , isQuitting_(false) {
+    , isQuitting_(false)
+    , isSleeping_(false)
+    , dispatchBatchLimit_(
+        options.dispatchBatchLimit ? options.dispatchBatchLimit : 1)
+    , spinWindow_(options.highResolution
+        ? options.spinWindow : std::chrono::nanoseconds::zero())
+    , nextWakeup_(SteadyTimePoint::min())
+    , overflowPolicy_(options.overflowPolicy)
+    , sendTimeout_(options.sendTimeout)
+    , blockedSenders_(0)
+    , rejected_(0)
+    , dropped_(0)
+    , highWaterMark_(options.highWaterMark)
+    , lowWaterMark_(std::min(options.lowWaterMark,
+        highWaterMark_ ? highWaterMark_ - 1 : 0))
+    , overHighWater_(false)
+    , idlePending_(true)
+    , watchers_(0) {
+  batch_.reserve(dispatchBatchLimit_);
+  messageQueue_.setCapacity(options.capacity);
+  if (options.eventPoller && detail::Looper::EventPoller::supported()) {
+    poller_.reset(new detail::Looper::EventPoller());
+  }
+  if (options.priorityLanes > 1) {
+    std::vector<unsigned int> weights;
+    if (options.laneSelection == LaneSelection::kWeighted) {
+      weights = options.laneWeights;
+      weights.resize(options.priorityLanes, 1);
+    }
+    messageQueue_.setLanes(options.priorityLanes, weights);
+  }
+#ifdef NX_LOOPER_LATENCY
+  if (options.latencyHistograms) {
+    latency_.reset(new detail::Looper::LatencyRecorder());
+  }
+#endif
+  if (options.timingWheel) {
+    messageQueue_.enableTimingWheel(
+        std::chrono::steady_clock::now(), options.timingWheelTick);
+  }
 }
 std::shared_ptr<Looper> Looper::threadLooper() {
   return looper_;
 }
 
 // can be called more than once
-bool Looper::prepare() {
+bool Looper::prepare(const LooperOptions& options) {
   if (!looper_) {
-    looper_.reset(new Looper());
+    looper_.reset(new Looper(options));
     looper_->threadId_ = std::this_thread::get_id();
     return true;
   }
@@ -70,63 +230,235 @@ bool Looper::prepare() {
 std::thread::id Looper::getThreadId() const {
   return threadId_;
 }
-bool Looper::send(MessageEnvelope envelope, SteadyTimePoint triggerTime) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
-  if (!isAlive()) return false;
+bool Looper::send(MessageEnvelope envelope, SteadyTimePoint triggerTime,
+    MessagePayload* payload) {
+  { // arbitrary block
+    std::unique_lock<std::mutex> lock(mutex_);
 
-  QueueIterator queueIt = messageQueue_.insert(
-      QueueType::value_type(triggerTime, QueueData(envelope)));
+    if (!isAlive()) return false;
 
-  IdMapIterator idIt = messageIdMap_.insert(
-      IdMapType::value_type(envelope.message()->id(), queueIt));
+    Node* node;
+    SteadyTimePoint deadline = SteadyTimePoint::min();
+    while (!(node = messageQueue_.push(envelope.handler(),
+        *envelope.message(), triggerTime, payload))) {
+      if (!makeRoom(&lock, envelope, &deadline)) return false;
+    }
+    detail::Trace::onSend(this, node, envelope.handler(), *envelope.message());
 
-  queueIt->second.idIterator_ = idIt;
+    // we need to wake up if this is due before the loop would otherwise
+    // wake, otherwise we're already set up properly
+    if (triggerTime < nextWakeup_) {
+      wake();
+    }
+  }
+  checkPressure();
+  return true;
+}
+bool Looper::send(MessageEnvelope envelope,
+    std::chrono::steady_clock::duration delay, MessagePayload* payload) {
+  if (delay.count() <= 0) {
+    return sendNow(envelope, payload);
+  }
+  return send(envelope, std::chrono::steady_clock::now() + delay, payload);
+}
+bool Looper::sendNow(MessageEnvelope envelope, MessagePayload* payload,
+    Node* node) {
+  if (!isAlive()) return false;
 
-  // we need to wake up if we added this to the beginning, otherwise we're
-  // already set up properly
-  if (queueIt == messageQueue_.begin()) {
-    conditionVariable_.notify_one();
+  // Callbacks without a handler continue work that was already accepted, so
+  // they are never turned away.
+  if (!messageQueue_.reserve(!envelope.handler())) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    SteadyTimePoint deadline = SteadyTimePoint::min();
+    do {
+      if (!makeRoom(&lock, envelope, &deadline)) return false;
+    } while (!messageQueue_.reserve());
+  }
+  Node* obtained = nullptr;
+  if (!node) {
+    node = obtained = detail::Looper::NodePool::obtain();
+  }
+  // before posting, after which the loop may already be dispatching it
+  detail::Trace::onSend(this, node, envelope.handler(), *envelope.message());
+  if (!messageQueue_.post(node, envelope.handler(), *envelope.message(),
+      std::chrono::steady_clock::now(), payload)) {
+    // the loop exited after isAlive() was checked, and would never see it
+    if (obtained) {
+      detail::Looper::NodePool::recycle(obtained);
+    }
+    return false;
   }
 
+  // Pairs with runLoop() checking the intake after setting isSleeping_; at
+  // least one side sees the other.  Only the first sender to find it asleep
+  // needs to take the lock, which is held by the loop until it is waiting.
+  if (isSleeping_.load() && isSleeping_.exchange(false)) {
+    if (poller_) {
+      poller_->wake();
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake();
+    }
+  }
+  checkPressure();
   return true;
 }
-bool Looper::send(MessageEnvelope envelope, std::chrono::milliseconds delay) {
-  return send(envelope, std::chrono::steady_clock::now() + delay);
+
+bool Looper::postCallback(MessagePayload* payload) {
+  return sendNow(MessageEnvelope(nullptr, Message()), payload);
 }
 
 void Looper::remove(Handler* handler, unsigned int id,
     bool checkData, void* data) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  Node* retired;
+  { // arbitrary block
+    std::lock_guard<std::mutex> lock(mutex_);
+    messageQueue_.drain();
+    // Removing can only push the next deadline back, so there's no need to
+    // wake the loop; at worst it wakes once to find nothing due.
+    messageQueue_.remove(handler, id, checkData, data);
+    detail::Trace::onRemove(this, handler, id, 0);
+    notifyRoom();
+    retired = messageQueue_.takeRetired();
+  }
+  retire(retired);
+  checkPressure();
+}
 
-  std::pair<IdMapIterator, IdMapIterator> range =
-      messageIdMap_.equal_range(id);
-  while (range.first != range.second) {
-    MessageEnvelope* envelope = &range.first->second->second.envelope_;
-    if (envelope->handler() == handler
-        && (!checkData || envelope->message()->data() == data)) {
-      messageQueue_.erase(range.first->second);
-      range.first = messageIdMap_.erase(range.first);
-    } else {
-      ++range.first;
+bool Looper::sendIfAbsent(MessageEnvelope envelope,
+    SteadyTimePoint triggerTime, MessagePayload* payload) {
+  { // arbitrary block
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (!isAlive()) return false;
+
+    messageQueue_.drain();
+    Node* node;
+    SteadyTimePoint deadline = SteadyTimePoint::min();
+    while (!(node = messageQueue_.pushIfAbsent(envelope.handler(),
+        *envelope.message(), triggerTime, payload))) {
+      // only a full queue is worth making room in
+      if (messageQueue_.contains(envelope.handler(),
+          envelope.message()->id())
+          || !makeRoom(&lock, envelope, &deadline)) {
+        return false;
+      }
+      // posts that were made while waiting may be the one being checked for
+      messageQueue_.drain();
+    }
+    detail::Trace::onSend(this, node, envelope.handler(), *envelope.message());
+    if (triggerTime < nextWakeup_) {
+      wake();
     }
   }
+  checkPressure();
+  return true;
+}
+
+bool Looper::sendPeriodic(MessageEnvelope envelope,
+    SteadyTimePoint triggerTime, std::chrono::steady_clock::duration period,
+    PeriodicPolicy policy, MissedTicks missedTicks, MessagePayload* payload) {
+  if (period <= std::chrono::steady_clock::duration::zero()) {
+    return false;
+  }
+  std::uint8_t flags = 0;
+  if (policy == PeriodicPolicy::kFixedDelay) {
+    flags |= Node::kFixedDelay;
+  }
+  if (missedTicks == MissedTicks::kFireAll) {
+    flags |= Node::kFireMissed;
+  }
+  { // arbitrary block
+    std::unique_lock<std::mutex> lock(mutex_);
 
-  conditionVariable_.notify_one();
+    if (!isAlive()) return false;
+
+    Node* node;
+    SteadyTimePoint deadline = SteadyTimePoint::min();
+    while (!(node = messageQueue_.pushPeriodic(envelope.handler(),
+        *envelope.message(), triggerTime, period, flags, payload))) {
+      if (!makeRoom(&lock, envelope, &deadline)) return false;
+    }
+    detail::Trace::onSend(this, node, envelope.handler(), *envelope.message());
+    if (triggerTime < nextWakeup_) {
+      wake();
+    }
+  }
+  checkPressure();
+  return true;
+}
+
+bool Looper::replace(MessageEnvelope envelope, SteadyTimePoint triggerTime,
+    MessagePayload* payload, ReplaceDeadline deadline) {
+  Node* retired;
+  { // arbitrary block
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (!isAlive()) return false;
+
+    messageQueue_.drain();
+    Node* node;
+    SteadyTimePoint roomDeadline = SteadyTimePoint::min();
+    while (!(node = messageQueue_.replace(envelope.handler(),
+        *envelope.message(), triggerTime, payload,
+        deadline == ReplaceDeadline::kKeepEarlier))) {
+      if (!makeRoom(&lock, envelope, &roomDeadline)) return false;
+      messageQueue_.drain();
+    }
+    detail::Trace::onSend(this, node, envelope.handler(), *envelope.message());
+    // the messages it replaced may have made room
+    notifyRoom();
+    if (node->when_ < nextWakeup_) {
+      wake();
+    }
+    retired = messageQueue_.takeRetired();
+  }
+  retire(retired);
+  checkPressure();
+  return true;
+}
+
+void Looper::removeAllMessages(const Handler* handler) {
+  Node* retired;
+  { // arbitrary block
+    std::lock_guard<std::mutex> lock(mutex_);
+    messageQueue_.drain();
+    messageQueue_.removeAll(handler);
+    detail::Trace::onRemove(this, handler, 0, detail::Trace::kAllMessages);
+    notifyRoom();
+    retired = messageQueue_.takeRetired();
+  }
+  retire(retired);
+  checkPressure();
+}
+
+bool Looper::removeCallback(const Handler* handler, unsigned int token) {
+  bool removed;
+  Node* retired;
+  { // arbitrary block
+    std::lock_guard<std::mutex> lock(mutex_);
+    messageQueue_.drain();
+    detail::Trace::onRemove(this, handler, token, detail::Trace::kCallback);
+    removed = messageQueue_.removeCallback(handler, token);
+    notifyRoom();
+    retired = messageQueue_.takeRetired();
+  }
+  retire(retired);
+  checkPressure();
+  return removed;
+}
+
+bool Looper::hasCallback(const Handler* handler, unsigned int token) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  messageQueue_.drain();
+  return messageQueue_.containsCallback(handler, token);
 }
 
 bool Looper::hasMessages(const Handler* handler, unsigned int id,
     bool checkData, void* data) {
   std::lock_guard<std::mutex> lock(mutex_);
-  for (auto range = messageIdMap_.equal_range(id);
-      range.first != range.second; ++range.first) {
-    MessageEnvelope* envelope = &range.first->second->second.envelope_;
-    if (envelope->handler() == handler
-        && (!checkData || envelope->message()->data() == data)) {
-      return true;
-    }
-  }
-  return false;
+  messageQueue_.drain();
+  return messageQueue_.contains(handler, id, checkData, data);
 }
 
 
@@ -137,6 +469,99 @@ void Looper::loop() {
 bool Looper::isAlive() {
   return !isQuitting_.load() && hasLooped_.load();
 }
+bool Looper::addFd(int fd, unsigned int events, FdCallback callback) {
+  if (!poller_ || !callback) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!poller_->add(fd, events)) {
+    return false;
+  }
+  fdCallbacks_[fd] = std::make_shared<FdCallback>(std::move(callback));
+  return true;
+}
+bool Looper::removeFd(int fd) {
+  if (!poller_) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = fdCallbacks_.find(fd);
+  if (it == fdCallbacks_.end()) {
+    return false;
+  }
+  poller_->remove(fd);
+  fdCallbacks_.erase(it);
+  return true;
+}
+unsigned int Looper::postSyncBarrier() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return messageQueue_.postBarrier(std::chrono::steady_clock::now());
+}
+bool Looper::removeSyncBarrier(unsigned int token) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!messageQueue_.removeBarrier(token)) {
+    return false;
+  }
+  // what it held back may be due
+  wake();
+  return true;
+}
+void Looper::addIdleHandler(IdleHandler* idleHandler) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (std::find(idleHandlers_.begin(), idleHandlers_.end(), idleHandler)
+      == idleHandlers_.end()) {
+    idleHandlers_.push_back(idleHandler);
+  }
+}
+void Looper::removeIdleHandler(IdleHandler* idleHandler) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  idleHandlers_.erase(
+      std::remove(idleHandlers_.begin(), idleHandlers_.end(), idleHandler),
+      idleHandlers_.end());
+  // so that a pass already under way doesn't reach it
+  std::replace(idleRunning_.begin(), idleRunning_.end(), idleHandler,
+      static_cast<IdleHandler*>(nullptr));
+}
+void Looper::addPressureListener(PressureListener* listener) {
+  std::lock_guard<std::mutex> lock(pressureMutex_);
+  if (std::find(pressureListeners_.begin(), pressureListeners_.end(),
+      listener) == pressureListeners_.end()) {
+    pressureListeners_.push_back(listener);
+  }
+}
+void Looper::removePressureListener(PressureListener* listener) {
+  std::lock_guard<std::mutex> lock(pressureMutex_);
+  pressureListeners_.erase(std::remove(pressureListeners_.begin(),
+      pressureListeners_.end(), listener), pressureListeners_.end());
+}
+LooperBatchStatistics Looper::batchStatistics() const {
+  return batchCounters_.snapshot();
+}
+LooperLatencyStatistics Looper::latencyStatistics() const {
+#ifdef NX_LOOPER_LATENCY
+  if (latency_) {
+    return latency_->snapshot();
+  }
+#endif
+  return LooperLatencyStatistics();
+}
+std::size_t Looper::queueDepth() const {
+  return messageQueue_.depth();
+}
+LooperQueueStatistics Looper::queueStatistics() const {
+  LooperQueueStatistics statistics;
+  statistics.depth = messageQueue_.depth();
+  statistics.capacity = messageQueue_.capacity();
+  statistics.rejected = rejected_.load(std::memory_order_relaxed);
+  statistics.dropped = dropped_.load(std::memory_order_relaxed);
+  return statistics;
+}
+LooperAllocationStatistics Looper::allocationStatistics() {
+  LooperAllocationStatistics statistics;
+  statistics.nodes = detail::Looper::NodePool::allocations();
+  statistics.payloadBlocks = detail::Payload::allocations();
+  return statistics;
+}
 void Looper::waitForLoop() {
   if (!hasLooped_.load()) {
     std::unique_lock<std::mutex> lock(mutex_);
@@ -147,11 +572,7 @@ void Looper::waitForLoop() {
 }
 void Looper::runLoop() {
   using std::chrono::steady_clock;
-  using std::chrono::milliseconds;
-  using std::chrono::duration_cast;
-  decltype(messageQueue_)::iterator it;
-  SteadyTimePoint when, now;
-  milliseconds delay;
+  SteadyTimePoint now;
 
   std::unique_lock<std::mutex> lock(mutex_);
   // We only allow you to loop once
@@ -159,38 +580,369 @@ void Looper::runLoop() {
     hasLooped_.store(true);
     runningConditionVariable_.notify_all();
     for ( ; !isQuitting_.load(); ) {
-      if (!messageQueue_.empty()) {
-        it = messageQueue_.begin();
-        MessageEnvelope* envelope = &it->second.envelope_;
-        when = it->first;
-        now = steady_clock::now();
-        delay =
-            duration_cast<milliseconds>(when - now);
-        if (delay.count() <= 0) {
-          // remove from queue
-          messageIdMap_.erase(it->second.idIterator_);
-          messageQueue_.erase(it);
+      messageQueue_.drain();
+      now = steady_clock::now();
+      // bring in anything parked in the timing wheel that is about to fire
+      messageQueue_.advance(now);
+      // take everything that is due as of this one clock sample
+      while (batch_.size() < dispatchBatchLimit_) {
+        // remove from queue; the node stays ours until it is released
+        Node* node = messageQueue_.pop(now);
+        if (!node) {
+          break;
+        }
+        batch_.push_back(node);
+      }
+      if (batch_.empty()) {
+        SteadyTimePoint deadline = messageQueue_.nextEvent();
+        if (idlePending_ && !idleHandlers_.empty()) {
+          idlePending_ = false;
+          runIdleHandlers(&lock, now, deadline);
+          // they may have sent messages, or taken up the time until one
+          continue;
+        }
+        if (deadline == SteadyTimePoint::max()) {
+          waitUntil(&lock, deadline);
+        } else if (deadline - now > spinWindow_) {
+          waitUntil(&lock, deadline - spinWindow_);
+        } else {
+          // close enough that sleeping would likely overshoot
           lock.unlock();
-          // Calling while unlocked, because other threads can send messages
-          // while we handle one.  In fact, the message handler itself may want
-          // to add messages.
-          envelope->handler()->dispatchMessage(*envelope->message());
+          std::this_thread::yield();
           lock.lock();
-        } else {
-          conditionVariable_.wait_for(lock, delay);
         }
+        dispatchFds(&lock);
+        continue;
+      }
+      if (poller_ && !fdCallbacks_.empty()) {
+        // don't let a steady stream of messages starve the descriptors
+        pollFds(&lock);
+      }
+      batchCounters_.record(batch_.size());
+      idlePending_ = true;
+      notifyRoom();
+      lock.unlock();
+      checkPressure();
+      // Calling while unlocked, because other threads can send messages
+      // while we handle one.  In fact, the message handler itself may want
+      // to add messages.
+#ifdef NX_LOOPER_LATENCY
+      if (latency_) {
+        dispatchTimed();
       } else {
-        conditionVariable_.wait(lock);
+        dispatchBatch();
+      }
+#else
+      dispatchBatch();
+#endif
+      // payloads are destroyed here so that their destructors run unlocked,
+      // other than those of periodic messages, which are sent again; nodes
+      // that retire() disposes of entirely are done with
+      for (Node*& node : batch_) {
+        if (!isPeriodic(node)
+            && !detail::Looper::NodePool::retire(node)) {
+          node = nullptr;
+        }
+      }
+      lock.lock();
+      SteadyTimePoint finished = SteadyTimePoint::min();
+      for (Node* node : batch_) {
+        if (!node) {
+          continue;
+        }
+        if (!isPeriodic(node)) {
+          messageQueue_.release(node);
+          continue;
+        }
+        if (finished == SteadyTimePoint::min()) {
+          finished = steady_clock::now();
+        }
+        messageQueue_.requeue(node, finished);
+      }
+      batch_.clear();
+      // periodic messages cancelled while they ran
+      if (Node* retired = messageQueue_.takeRetired()) {
+        lock.unlock();
+        retire(retired);
+        lock.lock();
       }
     }
   }
+  // sends that race quit() either make it in before the intake closes, to be
+  // dropped here, or fail
+  messageQueue_.close();
   messageQueue_.clear();
-  messageIdMap_.clear();
+  Node* retired = messageQueue_.takeRetired();
+  lock.unlock();
+  retire(retired);
+}
+void Looper::dispatch(Node* node) {
+  const bool watched = watchers_.load(std::memory_order_relaxed) != 0;
+  if (watched) {
+    beacon_.begin(node->handler_, node->message_.id(),
+        !node->handler_ || node->message_.isCallback(),
+        std::chrono::steady_clock::now());
+  }
+  detail::Trace::onDispatch(TraceEventType::kDispatchBegin, this, node);
+  if (node->handler_) {
+    node->handler_->dispatchMessage(node->message_);
+  } else {
+    node->payload_.invoke();
+  }
+  detail::Trace::onDispatch(TraceEventType::kDispatchEnd, this, node);
+  if (watched) {
+    beacon_.end();
+  }
+}
+void Looper::dispatchBatch() {
+  for (Node* node : batch_) {
+    if (isQuitting_.load()) {
+      break;
+    }
+    dispatch(node);
+  }
+}
+#ifdef NX_LOOPER_LATENCY
+void Looper::dispatchTimed() {
+  using std::chrono::steady_clock;
+  // each message's end is the next one's start
+  SteadyTimePoint start = steady_clock::now();
+  for (Node* node : batch_) {
+    if (isQuitting_.load()) {
+      break;
+    }
+    dispatch(node);
+    const SteadyTimePoint end = steady_clock::now();
+    // messages sent to the front of the queue were never due as such
+    const std::chrono::nanoseconds queueDelay =
+        node->when_ == SteadyTimePoint::min()
+        ? std::chrono::nanoseconds::zero() : start - node->when_;
+    latency_->record(!node->handler_ || node->message_.isCallback(),
+        node->message_.id(), queueDelay, end - start);
+    start = end;
+  }
+}
+#endif
+void Looper::waitUntil(std::unique_lock<std::mutex>* lock,
+    SteadyTimePoint deadline) {
+  isSleeping_.store(true);
+  // anything posted before isSleeping_ was set must be handled first
+  if (messageQueue_.drained()) {
+    nextWakeup_ = deadline;
+    if (poller_) {
+      lock->unlock();
+      poller_->wait(deadline, &readyFds_);
+      lock->lock();
+    } else if (deadline != SteadyTimePoint::max()) {
+      conditionVariable_.wait_until(*lock, deadline);
+    } else {
+      conditionVariable_.wait(*lock);
+    }
+    nextWakeup_ = SteadyTimePoint::min();
+  }
+  isSleeping_.store(false);
+}
+bool Looper::makeRoom(std::unique_lock<std::mutex>* lock,
+    const MessageEnvelope& envelope, SteadyTimePoint* deadline) {
+  const auto bump = [](std::atomic<std::uint64_t>* counter) {
+    counter->store(counter->load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+  };
+  switch (overflowPolicy_) {
+    case OverflowPolicy::kBlock: {
+      // the loop would be waiting on itself
+      if (std::this_thread::get_id() == threadId_) {
+        break;
+      }
+      if (*deadline == SteadyTimePoint::min()) {
+        const SteadyTimePoint now = std::chrono::steady_clock::now();
+        *deadline = sendTimeout_ < SteadyTimePoint::max() - now
+            ? now + std::chrono::duration_cast<SteadyTimePoint::duration>(
+                sendTimeout_)
+            : SteadyTimePoint::max();
+      }
+      const auto ready = [this]() {
+        return !isAlive() || !messageQueue_.full();
+      };
+      ++blockedSenders_;
+      if (*deadline == SteadyTimePoint::max()) {
+        roomConditionVariable_.wait(*lock, ready);
+      } else {
+        roomConditionVariable_.wait_until(*lock, *deadline, ready);
+      }
+      --blockedSenders_;
+      if (!isAlive()) {
+        return false;
+      }
+      if (!messageQueue_.full()) {
+        return true;
+      }
+      break;
+    }
+    case OverflowPolicy::kDropOldest:
+      bump(&dropped_);
+      if (envelope.handler() && !envelope.message()->isCallback()) {
+        messageQueue_.drain();
+        if (!messageQueue_.removeOldest(envelope.handler(),
+            envelope.message()->id())) {
+          return false;
+        }
+        // the caller retries, so the dropped payload can go unlocked
+        Node* retired = messageQueue_.takeRetired();
+        lock->unlock();
+        retire(retired);
+        lock->lock();
+        return true;
+      }
+      return false;
+    case OverflowPolicy::kDropNewest:
+      bump(&dropped_);
+      return false;
+    case OverflowPolicy::kFailFast:
+      break;
+  }
+  bump(&rejected_);
+  return false;
+}
+void Looper::retire(Node* retired) {
+  Node* pooled = nullptr;
+  while (retired) {
+    Node* node = retired;
+    retired = node->idNext_;
+    node->idNext_ = nullptr;
+    if (detail::Looper::NodePool::retire(node)) {
+      node->idNext_ = pooled;
+      pooled = node;
+    }
+  }
+  if (!pooled) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (pooled) {
+    Node* node = pooled;
+    pooled = node->idNext_;
+    messageQueue_.release(node);
+  }
+}
+void Looper::notifyRoom() {
+  if (blockedSenders_) {
+    roomConditionVariable_.notify_all();
+  }
+}
+void Looper::checkPressure() {
+  if (!highWaterMark_) {
+    return;
+  }
+  const std::size_t depth = messageQueue_.depth();
+  QueuePressure pressure;
+  if (depth >= highWaterMark_) {
+    if (overHighWater_.load(std::memory_order_relaxed)
+        || overHighWater_.exchange(true)) {
+      return;
+    }
+    pressure = QueuePressure::kHigh;
+  } else if (depth <= lowWaterMark_) {
+    if (!overHighWater_.load(std::memory_order_relaxed)
+        || !overHighWater_.exchange(false)) {
+      return;
+    }
+    pressure = QueuePressure::kLow;
+  } else {
+    return;
+  }
+  // copied so that they are called unlocked; crossings are rare
+  std::vector<PressureListener*> listeners;
+  { // arbitrary block
+    std::lock_guard<std::mutex> lock(pressureMutex_);
+    listeners = pressureListeners_;
+  }
+  for (PressureListener* listener : listeners) {
+    listener->onQueuePressure(pressure, depth);
+  }
+}
+void Looper::wake() {
+  if (poller_) {
+    poller_->wake();
+  } else {
+    conditionVariable_.notify_one();
+  }
+}
+void Looper::pollFds(std::unique_lock<std::mutex>* lock) {
+  lock->unlock();
+  poller_->wait(SteadyTimePoint::min(), &readyFds_);
+  lock->lock();
+  dispatchFds(lock);
+}
+void Looper::dispatchFds(std::unique_lock<std::mutex>* lock) {
+  if (readyFds_.empty()) {
+    return;
+  }
+  for (const auto& ready : readyFds_) {
+    auto it = fdCallbacks_.find(ready.first);
+    // it may have been removed since epoll reported it
+    if (it != fdCallbacks_.end()) {
+      fdDispatch_.push_back(
+          FdDispatch{ready.first, ready.second, it->second, true});
+    }
+  }
+  readyFds_.clear();
+  lock->unlock();
+  for (FdDispatch& dispatch : fdDispatch_) {
+    dispatch.keep = (*dispatch.callback)(dispatch.fd, dispatch.events);
+  }
+  lock->lock();
+  for (FdDispatch& dispatch : fdDispatch_) {
+    if (!dispatch.keep) {
+      // only if it wasn't replaced by the callback or another thread
+      auto it = fdCallbacks_.find(dispatch.fd);
+      if (it != fdCallbacks_.end() && it->second == dispatch.callback) {
+        poller_->remove(dispatch.fd);
+        fdCallbacks_.erase(it);
+      }
+    }
+  }
+  fdDispatch_.clear();
+}
+void Looper::runIdleHandlers(std::unique_lock<std::mutex>* lock,
+    SteadyTimePoint now, SteadyTimePoint deadline) {
+  const std::chrono::nanoseconds budget = deadline == SteadyTimePoint::max()
+      ? std::chrono::nanoseconds::max()
+      : std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+  idleRunning_ = idleHandlers_;
+  for (std::size_t i = 0; i < idleRunning_.size(); ++i) {
+    // read under the lock, as removeIdleHandler() clears what it removes
+    IdleHandler* idleHandler = idleRunning_[i];
+    if (!idleHandler) {
+      continue;
+    }
+    if (isQuitting_.load()) {
+      break;
+    }
+    lock->unlock();
+    const bool keep = idleHandler->queueIdle(budget);
+    lock->lock();
+    if (keep) {
+      idleRunning_[i] = nullptr;
+    }
+  }
+  // what's left asked to be removed, unless it wasn't reached
+  if (!isQuitting_.load()) {
+    for (IdleHandler* idleHandler : idleRunning_) {
+      if (idleHandler) {
+        idleHandlers_.erase(std::remove(idleHandlers_.begin(),
+            idleHandlers_.end(), idleHandler), idleHandlers_.end());
+      }
+    }
+  }
+  idleRunning_.clear();
 }
 void Looper::quit() {
   std::unique_lock<std::mutex> lock(mutex_);
   isQuitting_.store(true);
-  conditionVariable_.notify_one();
+  wake();
+  // blocked senders give up
+  notifyRoom();
 }
 
 }  // namespace nx
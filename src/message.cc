@@ -24,11 +24,19 @@ namespace nx {
 
 Message::Message(unsigned int id, void* data)
     : id_(id)
-    , data_(data) {
+    , data_(data)
+    , priority_(0)
+    , asynchronous_(false)
+    , payload_(nullptr)
+    , callback_(false) {
 }
 Message::Message(const Message& message) {
   id_ = message.id_;
   data_ = message.data_;
+  priority_ = message.priority_;
+  asynchronous_ = message.asynchronous_;
+  payload_ = message.payload_;
+  callback_ = message.callback_;
 }
 void* Message::data() const {
   return data_;
@@ -42,5 +50,23 @@ unsigned int Message::id() const {
 void Message::setId(unsigned int id) {
   id_ = id;
 }
+unsigned int Message::priority() const {
+  return priority_;
+}
+void Message::setPriority(unsigned int priority) {
+  priority_ = priority;
+}
+bool Message::isAsynchronous() const {
+  return asynchronous_;
+}
+void Message::setAsynchronous(bool asynchronous) {
+  asynchronous_ = asynchronous;
+}
+bool Message::hasPayload() const {
+  return payload_ && !payload_->empty();
+}
+bool Message::isCallback() const {
+  return callback_;
+}
 
 }  // namespace nx
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file message_payload.cc
+/// @brief Implementation for message_payload.h
+
+#include "nx/message_payload.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace detail {
+
+namespace Payload {
+
+namespace {
+
+// Size classes are powers of two from 64 bytes through 4KiB; anything larger
+// goes straight to the allocator.
+const std::size_t kSmallestClass = 64;
+const std::size_t kClasses = 7;
+// Beyond this many idle blocks in a class, freed blocks are released.
+const std::size_t kMaxIdle = 256;
+
+std::atomic<std::uint64_t> blockAllocations(0);
+
+struct SizeClass {
+  std::mutex mutex;
+  std::vector<void*> idle;
+};
+
+SizeClass* sizeClasses() {
+  // Intentionally leaked, so that payloads destroyed during static
+  // destruction still have somewhere to go.
+  static SizeClass* classes = new SizeClass[kClasses];
+  return classes;
+}
+
+// The index of the smallest class that fits size, or kClasses if none does.
+std::size_t classOf(std::size_t size) {
+  std::size_t index = 0;
+  for (std::size_t capacity = kSmallestClass; capacity < size;
+      capacity <<= 1) {
+    if (++index == kClasses) {
+      break;
+    }
+  }
+  return index;
+}
+
+}  // namespace
+
+void* allocate(std::size_t size) {
+  const std::size_t index = classOf(size);
+  if (index == kClasses) {
+    blockAllocations.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(size);
+  }
+  SizeClass& sizeClass = sizeClasses()[index];
+  {
+    std::lock_guard<std::mutex> lock(sizeClass.mutex);
+    if (!sizeClass.idle.empty()) {
+      void* block = sizeClass.idle.back();
+      sizeClass.idle.pop_back();
+      return block;
+    }
+  }
+  blockAllocations.fetch_add(1, std::memory_order_relaxed);
+  return ::operator new(kSmallestClass << index);
+}
+void deallocate(void* block, std::size_t size) {
+  const std::size_t index = classOf(size);
+  if (index != kClasses) {
+    SizeClass& sizeClass = sizeClasses()[index];
+    std::lock_guard<std::mutex> lock(sizeClass.mutex);
+    if (sizeClass.idle.size() < kMaxIdle) {
+      sizeClass.idle.push_back(block);
+      return;
+    }
+  }
+  ::operator delete(block);
+}
+std::uint64_t allocations() {
+  return blockAllocations.load(std::memory_order_relaxed);
+}
+
+}  // namespace Payload
+
+}  // namespace detail
+
+}  // namespace nx
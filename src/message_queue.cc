@@ -0,0 +1,1018 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file message_queue.cc
+/// @brief Implementation for message_queue.h
+
+#include "nx/message_queue.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "nx/future.h"
+#include "nx/timing_wheel.h"
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace detail {
+
+namespace Looper {
+
+namespace {
+
+// Recycled nodes move between threads this many at a time.
+const std::size_t kTransferBatch = 64;
+// Beyond this many batches in the depot, recycled nodes are deleted.
+const std::size_t kMaxDepotBatches = 64;
+
+std::atomic<std::uint64_t> nodeAllocations(0);
+
+// Batches of recycled nodes, each a list linked through idNext_.
+struct NodeDepot {
+  std::mutex mutex;
+  std::vector<Node*> batches;
+};
+
+NodeDepot* nodeDepot() {
+  // Intentionally leaked, so that threads exiting during static destruction
+  // still have somewhere to put their nodes.
+  static NodeDepot* depot = new NodeDepot();
+  return depot;
+}
+
+void deleteList(Node* node) {
+  while (node) {
+    Node* next = node->idNext_;
+    delete node;
+    node = next;
+  }
+}
+
+// Hands a list of kTransferBatch nodes to the depot, or deletes it if the
+// depot is full.
+void depositBatch(Node* batch) {
+  NodeDepot* depot = nodeDepot();
+  {
+    std::lock_guard<std::mutex> lock(depot->mutex);
+    if (depot->batches.size() < kMaxDepotBatches) {
+      depot->batches.push_back(batch);
+      return;
+    }
+  }
+  deleteList(batch);
+}
+
+Node* withdrawBatch() {
+  NodeDepot* depot = nodeDepot();
+  std::lock_guard<std::mutex> lock(depot->mutex);
+  if (depot->batches.empty()) {
+    return nullptr;
+  }
+  Node* batch = depot->batches.back();
+  depot->batches.pop_back();
+  return batch;
+}
+
+// The current thread's recycled nodes.  Trivially destructible, so that it
+// stays usable while other thread locals are destroyed; NodeCacheFlusher
+// gives its nodes away when the thread exits and retires it.
+struct NodeCache {
+  Node* head;
+  std::size_t count;
+  bool registered;
+  bool retired;
+};
+
+thread_local NodeCache nodeCache = {nullptr, 0, false, false};
+
+// Detaches the first count nodes of the cache, which must exist.
+Node* takeFromCache(std::size_t count) {
+  Node* first = nodeCache.head;
+  Node* last = first;
+  for (std::size_t i = 1; i < count; ++i) {
+    last = last->idNext_;
+  }
+  nodeCache.head = last->idNext_;
+  last->idNext_ = nullptr;
+  nodeCache.count -= count;
+  return first;
+}
+
+struct NodeCacheFlusher {
+  ~NodeCacheFlusher() {
+    // whatever doesn't make a full batch is freed
+    while (nodeCache.count >= kTransferBatch) {
+      depositBatch(takeFromCache(kTransferBatch));
+    }
+    deleteList(nodeCache.head);
+    nodeCache.head = nullptr;
+    nodeCache.count = 0;
+    nodeCache.retired = true;
+  }
+};
+
+void registerNodeCache() {
+  static thread_local NodeCacheFlusher flusher;
+  nodeCache.registered = true;
+}
+
+Node* popFromCache() {
+  if (!nodeCache.head) {
+    if (nodeCache.retired) {
+      return nullptr;
+    }
+    nodeCache.head = withdrawBatch();
+    if (!nodeCache.head) {
+      return nullptr;
+    }
+    nodeCache.count = kTransferBatch;
+    if (!nodeCache.registered) {
+      registerNodeCache();
+    }
+  }
+  Node* node = nodeCache.head;
+  nodeCache.head = node->idNext_;
+  node->idNext_ = nullptr;
+  --nodeCache.count;
+  return node;
+}
+
+void pushToCache(Node* node) {
+  if (nodeCache.retired) {
+    delete node;
+    return;
+  }
+  if (!nodeCache.registered) {
+    registerNodeCache();
+  }
+  node->idNext_ = nodeCache.head;
+  nodeCache.head = node;
+  // Keeps a batch in hand, so that a thread alternating between the two
+  // doesn't bounce a batch back and forth.
+  if (++nodeCache.count >= 2 * kTransferBatch) {
+    depositBatch(takeFromCache(kTransferBatch));
+  }
+}
+
+}  // namespace
+
+Node::Node()
+    : handler_(nullptr)
+    , sequence_(0)
+    , heapIndex_(kNotQueued)
+    , heapSlot_(0)
+    , idPrev_(nullptr)
+    , idNext_(nullptr)
+    , handlerPrev_(nullptr)
+    , handlerNext_(nullptr)
+    , wheelPrev_(nullptr)
+    , wheelNext_(nullptr)
+    , wheelSlot_(kNotParked)
+    , intakeNext_(nullptr)
+    , pooled_(false)
+    , periodic_(0)
+    , period_(0)
+    , callState_(nullptr)
+    , references_(0)
+#ifdef NX_LOOPER_TRACING
+    , traceFlow_(0)
+#endif
+{
+}
+
+// NodePool
+
+NodePool::NodePool()
+    : freeList_(nullptr) {
+}
+void NodePool::grow() {
+  std::unique_ptr<Node[]> chunk(new Node[kChunkSize]);
+  nodeAllocations.fetch_add(kChunkSize, std::memory_order_relaxed);
+  // thread them in order so that consecutive acquires are adjacent in memory
+  for (std::size_t i = kChunkSize; i != 0; --i) {
+    chunk[i - 1].pooled_ = true;
+    chunk[i - 1].idNext_ = freeList_;
+    freeList_ = &chunk[i - 1];
+  }
+  chunks_.push_back(std::move(chunk));
+}
+Node* NodePool::acquire() {
+  if (!freeList_) {
+    grow();
+  }
+  Node* node = freeList_;
+  freeList_ = node->idNext_;
+  node->idNext_ = nullptr;
+  return node;
+}
+Node* NodePool::obtain() {
+  if (Node* node = popFromCache()) {
+    return node;
+  }
+  nodeAllocations.fetch_add(1, std::memory_order_relaxed);
+  return new Node();
+}
+void NodePool::recycle(Node* node) {
+  node->handler_ = nullptr;
+  node->message_ = Message();
+  node->payload_.reset();
+  node->heapIndex_ = Node::kNotQueued;
+  node->idPrev_ = nullptr;
+  node->handlerPrev_ = nullptr;
+  node->handlerNext_ = nullptr;
+  node->callState_ = nullptr;
+  pushToCache(node);
+}
+void NodePool::unshare(Node* node) {
+  if (node->references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    recycle(node);
+  }
+}
+bool NodePool::retire(Node* node) {
+  if (node->callState_) {
+    // a no-op if it already ran
+    node->callState_->abandon();
+    unshare(node);
+    return false;
+  }
+  if (!node->pooled_) {
+    recycle(node);
+    return false;
+  }
+  // destroys the payload of a message that was removed or never dispatched
+  node->payload_.reset();
+  return true;
+}
+void NodePool::release(Node* node) {
+  if (!retire(node)) {
+    return;
+  }
+  node->handler_ = nullptr;
+  node->message_ = Message();
+  node->heapIndex_ = Node::kNotQueued;
+  node->idPrev_ = nullptr;
+  node->idNext_ = freeList_;
+  node->handlerPrev_ = nullptr;
+  node->handlerNext_ = nullptr;
+  freeList_ = node;
+}
+std::size_t NodePool::capacity() const {
+  return chunks_.size() * kChunkSize;
+}
+std::uint64_t NodePool::allocations() {
+  return nodeAllocations.load(std::memory_order_relaxed);
+}
+
+// NodeHeap
+
+bool NodeHeap::before(const Entry& lhs, const Entry& rhs) {
+  if (lhs.when != rhs.when) {
+    return lhs.when < rhs.when;
+  }
+  return lhs.sequence < rhs.sequence;
+}
+void NodeHeap::place(std::size_t index, const Entry& entry) {
+  entries_[index] = entry;
+  entry.node->heapIndex_ = index;
+}
+void NodeHeap::siftUp(std::size_t index) {
+  Entry entry = entries_[index];
+  while (index != 0) {
+    std::size_t parent = (index - 1) / kArity;
+    if (!before(entry, entries_[parent])) {
+      break;
+    }
+    place(index, entries_[parent]);
+    index = parent;
+  }
+  place(index, entry);
+}
+void NodeHeap::siftDown(std::size_t index) {
+  const std::size_t count = entries_.size();
+  Entry entry = entries_[index];
+  for (;;) {
+    std::size_t first = index * kArity + 1;
+    if (first >= count) {
+      break;
+    }
+    std::size_t last = first + kArity;
+    if (last > count) {
+      last = count;
+    }
+    std::size_t best = first;
+    for (std::size_t child = first + 1; child < last; ++child) {
+      if (before(entries_[child], entries_[best])) {
+        best = child;
+      }
+    }
+    if (!before(entries_[best], entry)) {
+      break;
+    }
+    place(index, entries_[best]);
+    index = best;
+  }
+  place(index, entry);
+}
+bool NodeHeap::empty() const {
+  return entries_.empty();
+}
+std::size_t NodeHeap::size() const {
+  return entries_.size();
+}
+Node* NodeHeap::top() const {
+  return entries_.empty() ? nullptr : entries_.front().node;
+}
+void NodeHeap::push(Node* node) {
+  entries_.push_back(Entry{node->when_, node->sequence_, node});
+  siftUp(entries_.size() - 1);
+}
+void NodeHeap::erase(Node* node) {
+  const std::size_t index = node->heapIndex_;
+  node->heapIndex_ = Node::kNotQueued;
+  const std::size_t last = entries_.size() - 1;
+  if (index != last) {
+    Entry moved = entries_[last];
+    entries_.pop_back();
+    place(index, moved);
+    if (index != 0 && before(moved, entries_[(index - 1) / kArity])) {
+      siftUp(index);
+    } else {
+      siftDown(index);
+    }
+  } else {
+    entries_.pop_back();
+  }
+}
+Node* NodeHeap::pop() {
+  Node* node = top();
+  if (node) {
+    erase(node);
+  }
+  return node;
+}
+void NodeHeap::clear() {
+  for (Entry& entry : entries_) {
+    entry.node->heapIndex_ = Node::kNotQueued;
+  }
+  entries_.clear();
+}
+
+// IntakeQueue
+
+IntakeQueue::IntakeQueue()
+    : head_(&stub_)
+    , pushers_(0)
+    , tail_(&stub_) {
+}
+void IntakeQueue::link(Node* node) {
+  node->intakeNext_.store(nullptr, std::memory_order_relaxed);
+  // This exchange is what orders the push against a Looper going to sleep,
+  // so it must be sequentially consistent.
+  Node* previous = head_.exchange(node);
+  previous->intakeNext_.store(node, std::memory_order_release);
+}
+bool IntakeQueue::push(Node* node) {
+  // Announcing the push and checking for closure are one step, so close()
+  // either sees the push under way and waits for it, or turns it away.
+  if (pushers_.fetch_add(kPusher) & kClosed) {
+    pushers_.fetch_sub(kPusher, std::memory_order_relaxed);
+    return false;
+  }
+  link(node);
+  pushers_.fetch_sub(kPusher, std::memory_order_release);
+  return true;
+}
+Node* IntakeQueue::pop() {
+  Node* tail = tail_;
+  Node* next = tail->intakeNext_.load(std::memory_order_acquire);
+  if (tail == &stub_) {
+    if (!next) {
+      return nullptr;
+    }
+    tail_ = next;
+    tail = next;
+    next = next->intakeNext_.load(std::memory_order_acquire);
+  }
+  if (next) {
+    tail_ = next;
+    return tail;
+  }
+  if (tail != head_.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  // tail is the last node; put the stub behind it so that it can be taken
+  link(&stub_);
+  next = tail->intakeNext_.load(std::memory_order_acquire);
+  if (next) {
+    tail_ = next;
+    return tail;
+  }
+  return nullptr;
+}
+bool IntakeQueue::empty() const {
+  return head_.load() == tail_;
+}
+void IntakeQueue::close() {
+  pushers_.fetch_or(kClosed);
+  // pushes that got in first are a few instructions from finishing
+  while (pushers_.load(std::memory_order_acquire) >= kPusher) {
+    std::this_thread::yield();
+  }
+}
+
+// MessageQueue
+
+MessageQueue::MessageQueue()
+    : heaps_(2)
+    , nextBarrierToken_(0)
+    , nextSequence_(0)
+    , depth_(0)
+    , capacity_(0)
+    , retired_(nullptr) {
+}
+MessageQueue::~MessageQueue() {
+  clear();
+  Node* node = takeRetired();
+  while (node) {
+    Node* next = node->idNext_;
+    node->idNext_ = nullptr;
+    pool_.release(node);
+    node = next;
+  }
+}
+void MessageQueue::enableTimingWheel(SteadyTimePoint origin,
+    std::chrono::nanoseconds tick) {
+  wheel_.reset(new TimingWheel(origin, tick));
+}
+void MessageQueue::setLanes(std::size_t count,
+    const std::vector<unsigned int>& weights) {
+  if (count == 0) {
+    count = 1;
+  }
+  heaps_ = std::vector<NodeHeap>(2 * count);
+  laneWeights_.clear();
+  laneCredits_.clear();
+  if (!weights.empty()) {
+    // lanes without a weight get one, and none may starve entirely
+    for (std::size_t lane = 0; lane < count; ++lane) {
+      const unsigned int weight = lane < weights.size() ? weights[lane] : 1;
+      laneWeights_.push_back(weight ? weight : 1);
+    }
+    laneCredits_.resize(count, 0);
+  }
+}
+std::size_t MessageQueue::lanes() const {
+  return heaps_.size() / 2;
+}
+void MessageQueue::setCapacity(std::size_t capacity) {
+  capacity_ = capacity;
+}
+std::size_t MessageQueue::capacity() const {
+  return capacity_;
+}
+std::size_t MessageQueue::depth() const {
+  return depth_.load(std::memory_order_relaxed);
+}
+bool MessageQueue::full() const {
+  return capacity_ && depth() >= capacity_;
+}
+bool MessageQueue::reserve(bool force) {
+  if (!capacity_ || force) {
+    depth_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  std::size_t depth = depth_.load(std::memory_order_relaxed);
+  do {
+    if (depth >= capacity_) {
+      return false;
+    }
+  } while (!depth_.compare_exchange_weak(depth, depth + 1,
+      std::memory_order_relaxed));
+  return true;
+}
+bool MessageQueue::IdKey::operator==(const IdKey& other) const {
+  return handler == other.handler && id == other.id
+      && callback == other.callback;
+}
+std::size_t MessageQueue::IdKeyHash::operator()(const IdKey& key) const {
+  std::size_t hash = std::hash<const Handler*>()(key.handler);
+  // boost::hash_combine
+  return hash ^ (std::hash<unsigned int>()(key.id) + (key.callback ? 1 : 0)
+      + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+}
+MessageQueue::IdKey MessageQueue::keyOf(const Node* node) {
+  return IdKey{node->handler_, node->message_.id(),
+      node->message_.isCallback()};
+}
+void MessageQueue::link(Node* node) {
+  Node*& head = idIndex_[keyOf(node)];
+  node->idPrev_ = nullptr;
+  node->idNext_ = head;
+  if (head) {
+    head->idPrev_ = node;
+  }
+  head = node;
+  Node*& handlerHead = handlerIndex_[node->handler_];
+  node->handlerPrev_ = nullptr;
+  node->handlerNext_ = handlerHead;
+  if (handlerHead) {
+    handlerHead->handlerPrev_ = node;
+  }
+  handlerHead = node;
+}
+void MessageQueue::unlink(Node* node) {
+  if (node->idPrev_) {
+    node->idPrev_->idNext_ = node->idNext_;
+  } else {
+    idIndex_[keyOf(node)] = node->idNext_;
+  }
+  if (node->idNext_) {
+    node->idNext_->idPrev_ = node->idPrev_;
+  }
+  node->idPrev_ = nullptr;
+  node->idNext_ = nullptr;
+  if (node->handlerPrev_) {
+    node->handlerPrev_->handlerNext_ = node->handlerNext_;
+  } else {
+    handlerIndex_[node->handler_] = node->handlerNext_;
+  }
+  if (node->handlerNext_) {
+    node->handlerNext_->handlerPrev_ = node->handlerPrev_;
+  }
+  node->handlerPrev_ = nullptr;
+  node->handlerNext_ = nullptr;
+}
+void MessageQueue::detach(Node* node) {
+  if (TimingWheel::contains(node)) {
+    wheel_->erase(node);
+  } else {
+    heaps_[node->heapSlot_].erase(node);
+  }
+  unlink(node);
+}
+void MessageQueue::retireLater(Node* node) {
+  node->idNext_ = retired_;
+  retired_ = node;
+}
+void MessageQueue::discard(Node* node) {
+  detach(node);
+  depth_.fetch_sub(1, std::memory_order_relaxed);
+  retireLater(node);
+}
+void MessageQueue::sweepIdIndex() {
+  // Amortized; only sweeps once the index has grown well past the live count.
+  if (idIndex_.size() <= 2 * size() + 64) {
+    return;
+  }
+  for (auto it = idIndex_.begin(); it != idIndex_.end(); ) {
+    if (!it->second) {
+      it = idIndex_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto it = handlerIndex_.begin(); it != handlerIndex_.end(); ) {
+    if (!it->second) {
+      it = handlerIndex_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+bool MessageQueue::empty() const {
+  return size() == 0;
+}
+std::size_t MessageQueue::size() const {
+  std::size_t size = wheel_ ? wheel_->size() : 0;
+  for (const NodeHeap& heap : heaps_) {
+    size += heap.size();
+  }
+  return size;
+}
+bool MessageQueue::blocked(const Node* node) const {
+  if (barriers_.empty() || node->message_.isAsynchronous()) {
+    return false;
+  }
+  const Barrier& barrier = barriers_.front();
+  return node->when_ != barrier.when
+      ? node->when_ > barrier.when : node->sequence_ > barrier.sequence;
+}
+Node* MessageQueue::laneTop(std::size_t lane) const {
+  Node* synchronous = heaps_[2 * lane].top();
+  Node* asynchronous = heaps_[2 * lane + 1].top();
+  // the heap is ordered, so if its top is held back everything behind it is
+  if (synchronous && blocked(synchronous)) {
+    synchronous = nullptr;
+  }
+  if (!synchronous || !asynchronous) {
+    return synchronous ? synchronous : asynchronous;
+  }
+  if (synchronous->when_ != asynchronous->when_) {
+    return synchronous->when_ < asynchronous->when_
+        ? synchronous : asynchronous;
+  }
+  return synchronous->sequence_ < asynchronous->sequence_
+      ? synchronous : asynchronous;
+}
+Node* MessageQueue::top() const {
+  Node* best = nullptr;
+  for (std::size_t lane = 0; lane < lanes(); ++lane) {
+    Node* node = laneTop(lane);
+    if (node && (!best || node->when_ < best->when_
+        || (node->when_ == best->when_ && node->sequence_ < best->sequence_))) {
+      best = node;
+    }
+  }
+  return best;
+}
+void MessageQueue::advance(SteadyTimePoint now) {
+  if (wheel_) {
+    wheel_->advance(now, heaps_.data());
+  }
+}
+SteadyTimePoint MessageQueue::nextEvent() const {
+  SteadyTimePoint when = SteadyTimePoint::max();
+  for (std::size_t lane = 0; lane < lanes(); ++lane) {
+    Node* node = laneTop(lane);
+    if (node && node->when_ < when) {
+      when = node->when_;
+    }
+  }
+  if (wheel_) {
+    SteadyTimePoint wheelWhen = wheel_->nextEvent();
+    if (wheelWhen < when) {
+      when = wheelWhen;
+    }
+  }
+  return when;
+}
+void MessageQueue::insert(Node* node) {
+  const unsigned int lane = static_cast<unsigned int>(
+      std::min<std::size_t>(node->message_.priority(), lanes() - 1));
+  node->heapSlot_ = 2 * lane + (node->message_.isAsynchronous() ? 1 : 0);
+  if (!wheel_ || !wheel_->insert(node)) {
+    heaps_[node->heapSlot_].push(node);
+  }
+  sweepIdIndex();
+  link(node);
+}
+void MessageQueue::assign(Node* node, Handler* handler,
+    const Message& message, SteadyTimePoint when, MessagePayload* payload) {
+  node->handler_ = handler;
+  node->message_ = message;
+  node->message_.payload_ = nullptr;
+  if (payload && !payload->empty()) {
+    node->payload_ = std::move(*payload);
+    node->message_.payload_ = &node->payload_;
+  }
+  node->when_ = when;
+  node->periodic_ = 0;
+  node->period_ = std::chrono::steady_clock::duration::zero();
+}
+Node* MessageQueue::push(Handler* handler, const Message& message,
+    SteadyTimePoint when, MessagePayload* payload) {
+  if (!reserve()) {
+    return nullptr;
+  }
+  Node* node = pool_.acquire();
+  assign(node, handler, message, when, payload);
+  node->sequence_ = nextSequence_.fetch_add(1, std::memory_order_relaxed);
+  insert(node);
+  return node;
+}
+bool MessageQueue::post(Node* node, Handler* handler, const Message& message,
+    SteadyTimePoint when, MessagePayload* payload) {
+  assign(node, handler, message, when, payload);
+  // Taking the sequence here, rather than in drain(), keeps a producer's
+  // messages in the order it sent them regardless of which path they took.
+  node->sequence_ = nextSequence_.fetch_add(1, std::memory_order_relaxed);
+  if (intake_.push(node)) {
+    return true;
+  }
+  if (payload && node->message_.payload_) {
+    *payload = std::move(node->payload_);
+  }
+  depth_.fetch_sub(1, std::memory_order_relaxed);
+  return false;
+}
+Node* MessageQueue::pushIfAbsent(Handler* handler, const Message& message,
+    SteadyTimePoint when, MessagePayload* payload) {
+  if (contains(IdKey{handler, message.id(), false}, false, nullptr)) {
+    return nullptr;
+  }
+  return push(handler, message, when, payload);
+}
+Node* MessageQueue::replace(Handler* handler, const Message& message,
+    SteadyTimePoint when, MessagePayload* payload, bool keepEarlier) {
+  auto it = idIndex_.find(IdKey{handler, message.id(), false});
+  if (it == idIndex_.end() || !it->second) {
+    return push(handler, message, when, payload);
+  }
+  // the earliest due takes the replacement, and the rest are dropped
+  Node* node = it->second;
+  for (Node* other = node->idNext_; other; other = other->idNext_) {
+    if (other->when_ < node->when_ || (other->when_ == node->when_
+        && other->sequence_ < node->sequence_)) {
+      node = other;
+    }
+  }
+  for (Node* other = it->second; other; ) {
+    Node* next = other->idNext_;
+    if (other != node) {
+      discard(other);
+    }
+    other = next;
+  }
+  const SteadyTimePoint pendingWhen = node->when_;
+  const std::uint64_t pendingSequence = node->sequence_;
+  // the replaced payload goes with its node, to be destroyed unlocked
+  discard(node);
+  reserve(true);
+  node = pool_.acquire();
+  assign(node, handler, message, when, payload);
+  if (keepEarlier && pendingWhen <= when) {
+    node->when_ = pendingWhen;
+    node->sequence_ = pendingSequence;
+  } else {
+    node->sequence_ = nextSequence_.fetch_add(1, std::memory_order_relaxed);
+  }
+  insert(node);
+  return node;
+}
+Node* MessageQueue::pushPeriodic(Handler* handler, const Message& message,
+    SteadyTimePoint when, std::chrono::steady_clock::duration period,
+    std::uint8_t flags, MessagePayload* payload) {
+  if (!reserve()) {
+    return nullptr;
+  }
+  Node* node = pool_.acquire();
+  assign(node, handler, message, when, payload);
+  node->periodic_ = flags;
+  node->period_ = period;
+  node->sequence_ = nextSequence_.fetch_add(1, std::memory_order_relaxed);
+  insert(node);
+  return node;
+}
+void MessageQueue::requeue(Node* node, SteadyTimePoint now) {
+  running_.erase(std::find(running_.begin(), running_.end(), node));
+  if (node->periodic_ & Node::kCancelled) {
+    retireLater(node);
+    return;
+  }
+  if (node->periodic_ & Node::kFixedDelay) {
+    node->when_ = now + node->period_;
+  } else {
+    // from when it was due, so that dispatch latency doesn't accumulate
+    node->when_ += node->period_;
+    if (node->when_ <= now && !(node->periodic_ & Node::kFireMissed)) {
+      // the next tick in phase with the ones that were missed
+      node->when_ += (now - node->when_) / node->period_ * node->period_
+          + node->period_;
+    }
+  }
+#ifdef NX_LOOPER_TRACING
+  node->traceFlow_ = 0;
+#endif
+  // it had room before it was taken, so it isn't turned away now
+  reserve(true);
+  node->sequence_ = nextSequence_.fetch_add(1, std::memory_order_relaxed);
+  insert(node);
+}
+void MessageQueue::drain() {
+  for (;;) {
+    if (Node* node = intake_.pop()) {
+      insert(node);
+    } else if (intake_.empty()) {
+      break;
+    } else {
+      // A producer is between the two halves of its push; it is never more
+      // than a couple of instructions from finishing unless preempted.
+      std::this_thread::yield();
+    }
+  }
+}
+bool MessageQueue::drained() const {
+  return intake_.empty();
+}
+void MessageQueue::close() {
+  intake_.close();
+  drain();
+}
+Node* MessageQueue::take(Node* node) {
+  if (node) {
+    heaps_[node->heapSlot_].erase(node);
+    unlink(node);
+    depth_.fetch_sub(1, std::memory_order_relaxed);
+    if (node->period_ != std::chrono::steady_clock::duration::zero()) {
+      running_.push_back(node);
+    }
+  }
+  return node;
+}
+Node* MessageQueue::pop() {
+  return take(top());
+}
+Node* MessageQueue::pop(SteadyTimePoint now) {
+  const std::size_t count = lanes();
+  if (laneWeights_.empty()) {
+    for (std::size_t lane = 0; lane < count; ++lane) {
+      Node* node = laneTop(lane);
+      if (node && node->when_ <= now) {
+        return take(node);
+      }
+    }
+    return nullptr;
+  }
+  // Smooth weighted round robin, among the lanes that have something due.
+  Node* best = nullptr;
+  std::size_t bestLane = 0;
+  std::int64_t total = 0;
+  for (std::size_t lane = 0; lane < count; ++lane) {
+    Node* node = laneTop(lane);
+    if (!node || node->when_ > now) {
+      continue;
+    }
+    laneCredits_[lane] += laneWeights_[lane];
+    total += laneWeights_[lane];
+    if (!best || laneCredits_[lane] > laneCredits_[bestLane]) {
+      best = node;
+      bestLane = lane;
+    }
+  }
+  if (best) {
+    laneCredits_[bestLane] -= total;
+  }
+  return take(best);
+}
+unsigned int MessageQueue::postBarrier(SteadyTimePoint when) {
+  Barrier barrier{when, nextSequence_.fetch_add(1, std::memory_order_relaxed),
+      ++nextBarrierToken_};
+  auto it = barriers_.end();
+  while (it != barriers_.begin() && (it - 1)->when > when) {
+    --it;
+  }
+  barriers_.insert(it, barrier);
+  return barrier.token;
+}
+bool MessageQueue::removeBarrier(unsigned int token) {
+  for (auto it = barriers_.begin(); it != barriers_.end(); ++it) {
+    if (it->token == token) {
+      barriers_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+void MessageQueue::release(Node* node) {
+  pool_.release(node);
+}
+Node* MessageQueue::takeRetired() {
+  Node* retired = retired_;
+  retired_ = nullptr;
+  return retired;
+}
+std::size_t MessageQueue::remove(const Handler* handler, unsigned int id,
+    bool checkData, void* data) {
+  return remove(IdKey{handler, id, false}, checkData, data);
+}
+bool MessageQueue::removeCallback(const Handler* handler, unsigned int token) {
+  return remove(IdKey{handler, token, true}, false, nullptr) != 0;
+}
+std::size_t MessageQueue::cancelRunning(const IdKey& key, bool checkData,
+    void* data) {
+  std::size_t cancelled = 0;
+  for (Node* node : running_) {
+    if (!(node->periodic_ & Node::kCancelled) && keyOf(node) == key
+        && (!checkData || node->message_.data() == data)) {
+      node->periodic_ |= Node::kCancelled;
+      ++cancelled;
+    }
+  }
+  return cancelled;
+}
+std::size_t MessageQueue::remove(const IdKey& key, bool checkData,
+    void* data) {
+  std::size_t removed = running_.empty() ? 0
+      : cancelRunning(key, checkData, data);
+  auto it = idIndex_.find(key);
+  if (it == idIndex_.end()) {
+    return removed;
+  }
+  Node* node = it->second;
+  while (node) {
+    Node* next = node->idNext_;
+    if (!checkData || node->message_.data() == data) {
+      discard(node);
+      ++removed;
+    }
+    node = next;
+  }
+  return removed;
+}
+std::size_t MessageQueue::removeAll(const Handler* handler) {
+  std::size_t removed = 0;
+  for (Node* node : running_) {
+    if (!(node->periodic_ & Node::kCancelled) && node->handler_ == handler) {
+      node->periodic_ |= Node::kCancelled;
+      ++removed;
+    }
+  }
+  auto it = handlerIndex_.find(handler);
+  if (it == handlerIndex_.end()) {
+    return removed;
+  }
+  while (Node* node = it->second) {
+    discard(node);
+    ++removed;
+  }
+  return removed;
+}
+bool MessageQueue::removeOldest(const Handler* handler, unsigned int id) {
+  auto it = idIndex_.find(IdKey{handler, id, false});
+  if (it == idIndex_.end() || !it->second) {
+    return false;
+  }
+  Node* oldest = it->second;
+  for (Node* node = oldest->idNext_; node; node = node->idNext_) {
+    if (node->sequence_ < oldest->sequence_) {
+      oldest = node;
+    }
+  }
+  discard(oldest);
+  return true;
+}
+bool MessageQueue::contains(const Handler* handler, unsigned int id,
+    bool checkData, void* data) const {
+  return contains(IdKey{handler, id, false}, checkData, data);
+}
+bool MessageQueue::containsCallback(const Handler* handler,
+    unsigned int token) const {
+  return contains(IdKey{handler, token, true}, false, nullptr);
+}
+bool MessageQueue::contains(const IdKey& key, bool checkData,
+    void* data) const {
+  // a periodic message being dispatched is still pending its next firing
+  for (Node* node : running_) {
+    if (!(node->periodic_ & Node::kCancelled) && keyOf(node) == key
+        && (!checkData || node->message_.data() == data)) {
+      return true;
+    }
+  }
+  auto it = idIndex_.find(key);
+  if (it == idIndex_.end()) {
+    return false;
+  }
+  for (Node* node = it->second; node; node = node->idNext_) {
+    if (!checkData || node->message_.data() == data) {
+      return true;
+    }
+  }
+  return false;
+}
+void MessageQueue::clear() {
+  drain();
+  for (NodeHeap& heap : heaps_) {
+    while (Node* node = heap.pop()) {
+      node->idPrev_ = nullptr;
+      node->handlerPrev_ = nullptr;
+      node->handlerNext_ = nullptr;
+      retireLater(node);
+    }
+  }
+  if (wheel_) {
+    while (Node* node = wheel_->extract()) {
+      node->idPrev_ = nullptr;
+      node->handlerPrev_ = nullptr;
+      node->handlerNext_ = nullptr;
+      retireLater(node);
+    }
+  }
+  idIndex_.clear();
+  handlerIndex_.clear();
+  barriers_.clear();
+  depth_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace Looper
+
+}  // namespace detail
+
+}  // namespace nx
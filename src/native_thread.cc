@@ -0,0 +1,285 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file native_thread.cc
+/// @brief Implementation for native_thread.h
+
+#include "nx/native_thread.h"
+
+#include <cerrno>
+#include <utility>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// @brief Library namespace.
+namespace nx {
+
+ThreadOptions::ThreadOptions()
+    : scheduling(ThreadScheduling::kInherit)
+    , priority(0)
+    , stackSize(0) {
+}
+
+ThreadSettings::ThreadSettings()
+    : nativeId(0)
+    , scheduling(ThreadScheduling::kInherit)
+    , priority(0)
+    , stackSize(0) {
+}
+
+namespace detail {
+
+#if defined(__linux__)
+
+namespace {
+
+// Linux limits names to 16 bytes, including the terminator.
+const std::size_t kMaxNameLength = 15;
+
+int currentNativeId() {
+  return static_cast<int>(syscall(SYS_gettid));
+}
+
+std::error_code errorCode(int error) {
+  return std::error_code(error, std::generic_category());
+}
+
+int toPolicy(ThreadScheduling scheduling) {
+  switch (scheduling) {
+    case ThreadScheduling::kBatch:
+      return SCHED_BATCH;
+    case ThreadScheduling::kIdle:
+      return SCHED_IDLE;
+    case ThreadScheduling::kFifo:
+      return SCHED_FIFO;
+    case ThreadScheduling::kRoundRobin:
+      return SCHED_RR;
+    default:
+      return SCHED_OTHER;
+  }
+}
+
+ThreadScheduling fromPolicy(int policy) {
+  switch (policy) {
+    case SCHED_BATCH:
+      return ThreadScheduling::kBatch;
+    case SCHED_IDLE:
+      return ThreadScheduling::kIdle;
+    case SCHED_FIFO:
+      return ThreadScheduling::kFifo;
+    case SCHED_RR:
+      return ThreadScheduling::kRoundRobin;
+    default:
+      return ThreadScheduling::kOther;
+  }
+}
+
+bool isRealTime(ThreadScheduling scheduling) {
+  return scheduling == ThreadScheduling::kFifo
+      || scheduling == ThreadScheduling::kRoundRobin;
+}
+
+}  // namespace
+
+void* NativeThread::start(void* self) {
+  NativeThread* thread = static_cast<NativeThread*>(self);
+  thread->nativeId_.store(currentNativeId(), std::memory_order_release);
+  thread->function_();
+  return nullptr;
+}
+NativeThread::NativeThread(std::function<void()> function,
+    std::size_t stackSize)
+    : function_(std::move(function))
+    , handle_()
+    , joinable_(false)
+    , nativeId_(0) {
+  pthread_attr_t attributes;
+  int error = pthread_attr_init(&attributes);
+  if (!error && stackSize) {
+    error = pthread_attr_setstacksize(&attributes, stackSize);
+  }
+  if (!error) {
+    error = pthread_create(&handle_, &attributes, &NativeThread::start,
+        this);
+  }
+  pthread_attr_destroy(&attributes);
+  if (error) {
+    throw std::system_error(errorCode(error), "NativeThread");
+  }
+  joinable_ = true;
+}
+NativeThread::~NativeThread() {
+  if (joinable_) {
+    // join() would throw; a destructor can only let it go
+    pthread_join(handle_, nullptr);
+  }
+}
+bool NativeThread::joinable() const {
+  return joinable_;
+}
+void NativeThread::join() {
+  if (!joinable_) {
+    throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+        "NativeThread::join");
+  }
+  const int error = pthread_join(handle_, nullptr);
+  if (error) {
+    throw std::system_error(errorCode(error), "NativeThread::join");
+  }
+  joinable_ = false;
+}
+ThreadSettings NativeThread::settings() const {
+  ThreadSettings settings;
+  settings.nativeId = nativeId_.load(std::memory_order_acquire);
+  if (!joinable_) {
+    return settings;
+  }
+  char name[kMaxNameLength + 1];
+  if (pthread_getname_np(handle_, name, sizeof(name)) == 0) {
+    settings.name = name;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (pthread_getaffinity_np(handle_, sizeof(cpus), &cpus) == 0) {
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &cpus)) {
+        settings.cpuAffinity.push_back(cpu);
+      }
+    }
+  }
+  int policy;
+  sched_param parameters;
+  if (pthread_getschedparam(handle_, &policy, &parameters) == 0) {
+    settings.scheduling = fromPolicy(policy);
+    if (isRealTime(settings.scheduling)) {
+      settings.priority = parameters.sched_priority;
+    } else {
+      settings.priority = getpriority(PRIO_PROCESS,
+          static_cast<id_t>(settings.nativeId));
+    }
+  }
+  pthread_attr_t attributes;
+  if (pthread_getattr_np(handle_, &attributes) == 0) {
+    pthread_attr_getstacksize(&attributes, &settings.stackSize);
+    pthread_attr_destroy(&attributes);
+  }
+  return settings;
+}
+std::error_code NativeThread::applyToCurrentThread(
+    const ThreadOptions& options) {
+  const pthread_t self = pthread_self();
+  if (!options.name.empty()) {
+    const int error = pthread_setname_np(self,
+        options.name.substr(0, kMaxNameLength).c_str());
+    if (error) {
+      return errorCode(error);
+    }
+  }
+  if (!options.cpuAffinity.empty()) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (unsigned int cpu : options.cpuAffinity) {
+      if (cpu >= CPU_SETSIZE) {
+        return std::make_error_code(std::errc::invalid_argument);
+      }
+      CPU_SET(cpu, &cpus);
+    }
+    const int error = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+    if (error) {
+      return errorCode(error);
+    }
+  }
+  if (options.scheduling != ThreadScheduling::kInherit) {
+    sched_param parameters = sched_param();
+    if (isRealTime(options.scheduling)) {
+      parameters.sched_priority = options.priority;
+    }
+    const int error = pthread_setschedparam(self,
+        toPolicy(options.scheduling), &parameters);
+    if (error) {
+      return errorCode(error);
+    }
+    // on Linux, the nice value belongs to the thread rather than the process
+    if (options.scheduling == ThreadScheduling::kOther
+        || options.scheduling == ThreadScheduling::kBatch) {
+      if (setpriority(PRIO_PROCESS, static_cast<id_t>(currentNativeId()),
+          options.priority) != 0) {
+        return errorCode(errno);
+      }
+    }
+  }
+  return std::error_code();
+}
+
+#else  // !defined(__linux__)
+
+void* NativeThread::start(void* self) {
+  static_cast<NativeThread*>(self)->function_();
+  return nullptr;
+}
+NativeThread::NativeThread(std::function<void()> function,
+    std::size_t stackSize)
+    : function_(std::move(function))
+    , handle_()
+    , joinable_(false)
+    , nativeId_(0) {
+  if (stackSize) {
+    throw std::system_error(std::make_error_code(std::errc::not_supported),
+        "NativeThread");
+  }
+  thread_ = std::thread(&NativeThread::start, this);
+  joinable_ = true;
+}
+NativeThread::~NativeThread() {
+  if (joinable_) {
+    try {
+      join();
+    } catch (...) {
+      // a destructor can only let it go
+    }
+  }
+}
+bool NativeThread::joinable() const {
+  return joinable_;
+}
+void NativeThread::join() {
+  thread_.join();
+  joinable_ = false;
+}
+ThreadSettings NativeThread::settings() const {
+  return ThreadSettings();
+}
+std::error_code NativeThread::applyToCurrentThread(
+    const ThreadOptions& options) {
+  // names are only a hint, so they are quietly dropped
+  if (!options.cpuAffinity.empty()
+      || options.scheduling != ThreadScheduling::kInherit) {
+    return std::make_error_code(std::errc::not_supported);
+  }
+  return std::error_code();
+}
+
+#endif  // defined(__linux__)
+
+}  // namespace detail
+
+}  // namespace nx
@@ -0,0 +1,224 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file timing_wheel.cc
+/// @brief Implementation for timing_wheel.h
+
+#include "nx/timing_wheel.h"
+
+#include <stdexcept>
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace detail {
+
+namespace Looper {
+
+namespace {
+
+const std::uint64_t kNoTick = static_cast<std::uint64_t>(-1);
+
+// Distance from bit 'from' to the next set bit at or after it, wrapping
+// around.  The bitmap must not be zero.
+unsigned int distanceToSetBit(std::uint64_t bitmap, unsigned int from) {
+  std::uint64_t rotated = from == 0
+      ? bitmap : (bitmap >> from) | (bitmap << (64 - from));
+#if defined(__GNUC__)
+  return static_cast<unsigned int>(__builtin_ctzll(rotated));
+#else
+  unsigned int distance = 0;
+  for ( ; !(rotated & 1); rotated >>= 1) {
+    ++distance;
+  }
+  return distance;
+#endif
+}
+
+}  // namespace
+
+TimingWheel::TimingWheel(SteadyTimePoint origin,
+    std::chrono::nanoseconds tick)
+    : origin_(origin)
+    , tick_(tick)
+    , current_(0)
+    , size_(0) {
+  // tickOf() divides by it
+  if (tick <= std::chrono::nanoseconds::zero()) {
+    throw std::invalid_argument("TimingWheel tick must be positive.");
+  }
+  for (unsigned int level = 0; level < kLevels; ++level) {
+    occupied_[level] = 0;
+    for (unsigned int slot = 0; slot < kSlots; ++slot) {
+      slots_[level][slot] = nullptr;
+    }
+  }
+}
+bool TimingWheel::empty() const {
+  return size_ == 0;
+}
+std::size_t TimingWheel::size() const {
+  return size_;
+}
+bool TimingWheel::contains(const Node* node) {
+  return node->wheelSlot_ != Node::kNotParked;
+}
+std::uint64_t TimingWheel::tickOf(SteadyTimePoint when) const {
+  if (when <= origin_) {
+    return 0;
+  }
+  return static_cast<std::uint64_t>((when - origin_) / tick_);
+}
+void TimingWheel::link(Node* node, unsigned int level, unsigned int slot) {
+  Node*& head = slots_[level][slot];
+  node->wheelSlot_ = level * kSlots + slot;
+  node->wheelPrev_ = nullptr;
+  node->wheelNext_ = head;
+  if (head) {
+    head->wheelPrev_ = node;
+  }
+  head = node;
+  occupied_[level] |= std::uint64_t(1) << slot;
+  ++size_;
+}
+void TimingWheel::erase(Node* node) {
+  const unsigned int level = node->wheelSlot_ / kSlots;
+  const unsigned int slot = node->wheelSlot_ % kSlots;
+  if (node->wheelPrev_) {
+    node->wheelPrev_->wheelNext_ = node->wheelNext_;
+  } else {
+    slots_[level][slot] = node->wheelNext_;
+    if (!node->wheelNext_) {
+      occupied_[level] &= ~(std::uint64_t(1) << slot);
+    }
+  }
+  if (node->wheelNext_) {
+    node->wheelNext_->wheelPrev_ = node->wheelPrev_;
+  }
+  node->wheelPrev_ = nullptr;
+  node->wheelNext_ = nullptr;
+  node->wheelSlot_ = Node::kNotParked;
+  --size_;
+}
+void TimingWheel::bin(Node* node, NodeHeap* heaps) {
+  const std::uint64_t tick = tickOf(node->when_);
+  if (tick <= current_) {
+    heaps[node->heapSlot_].push(node);
+    return;
+  }
+  const std::uint64_t delta = tick - current_;
+  unsigned int level = 0;
+  while (delta >> (kSlotBits * (level + 1))) {
+    ++level;
+  }
+  link(node, level,
+      static_cast<unsigned int>((tick >> (kSlotBits * level)) & (kSlots - 1)));
+}
+bool TimingWheel::insert(Node* node) {
+  const std::uint64_t tick = tickOf(node->when_);
+  // Anything due within the next tick is about to fire anyway, and anything
+  // beyond the last level is rare enough that the heap can have it.
+  if (tick <= current_ + 1
+      || (tick - current_) >> (kSlotBits * kLevels)) {
+    return false;
+  }
+  bin(node, nullptr);
+  return true;
+}
+std::uint64_t TimingWheel::nextEventTick() const {
+  std::uint64_t next = kNoTick;
+  for (unsigned int level = 0; level < kLevels; ++level) {
+    if (!occupied_[level]) {
+      continue;
+    }
+    // The slot at the current index has already been processed, so the
+    // nearest candidate is the one after it, up to a full revolution away.
+    const unsigned int shift = kSlotBits * level;
+    const std::uint64_t block = current_ >> shift;
+    const unsigned int index = static_cast<unsigned int>(block & (kSlots - 1));
+    const std::uint64_t distance = 1 + distanceToSetBit(occupied_[level],
+        (index + 1) & (kSlots - 1));
+    const std::uint64_t tick = (block + distance) << shift;
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+void TimingWheel::process(std::uint64_t tick, NodeHeap* heaps) {
+  // Cascade the higher levels whose slot boundary this is, highest first, so
+  // that everything lands where it belongs before level 0 is expired.
+  for (unsigned int level = kLevels - 1; level != 0; --level) {
+    const unsigned int shift = kSlotBits * level;
+    if (tick & ((std::uint64_t(1) << shift) - 1)) {
+      continue;
+    }
+    const unsigned int slot =
+        static_cast<unsigned int>((tick >> shift) & (kSlots - 1));
+    Node* node = slots_[level][slot];
+    while (node) {
+      Node* next = node->wheelNext_;
+      erase(node);
+      bin(node, heaps);
+      node = next;
+    }
+  }
+  const unsigned int slot = static_cast<unsigned int>(tick & (kSlots - 1));
+  Node* node = slots_[0][slot];
+  while (node) {
+    Node* next = node->wheelNext_;
+    erase(node);
+    heaps[node->heapSlot_].push(node);
+    node = next;
+  }
+}
+void TimingWheel::advance(SteadyTimePoint now, NodeHeap* heaps) {
+  const std::uint64_t target = tickOf(now);
+  while (current_ < target) {
+    // Every slot between here and the next occupied one is empty, so there is
+    // nothing to do for the ticks in between.
+    std::uint64_t next = nextEventTick();
+    if (next > target) {
+      current_ = target;
+      break;
+    }
+    current_ = next;
+    process(current_, heaps);
+  }
+}
+SteadyTimePoint TimingWheel::nextEvent() const {
+  const std::uint64_t tick = nextEventTick();
+  if (tick == kNoTick) {
+    return SteadyTimePoint::max();
+  }
+  return origin_ + tick_ * static_cast<std::chrono::nanoseconds::rep>(tick);
+}
+Node* TimingWheel::extract() {
+  for (unsigned int level = 0; level < kLevels; ++level) {
+    if (occupied_[level]) {
+      Node* node = slots_[level][distanceToSetBit(occupied_[level], 0)];
+      erase(node);
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace Looper
+
+}  // namespace detail
+
+}  // namespace nx
@@ -0,0 +1,305 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file trace.cc
+/// @brief Implementation for trace.h
+
+#include "nx/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// @brief Library namespace.
+namespace nx {
+
+#ifdef NX_LOOPER_TRACING
+
+namespace detail {
+
+namespace Trace {
+
+std::atomic<bool> tracing(false);
+
+namespace {
+
+// Flows are unique across threads by starting with the thread's index.
+const unsigned int kFlowIndexShift = 40;
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  std::uint64_t nextIndex = 1;
+};
+
+Registry* registry() {
+  // Intentionally leaked, as threads may record during static destruction.
+  static Registry* registry = new Registry();
+  return registry;
+}
+
+// Marks the thread's buffer as retired as the thread exits.
+struct Retirer {
+  Buffer* buffer = nullptr;
+  ~Retirer() {
+    if (buffer) {
+      buffer->retired.store(true, std::memory_order_relaxed);
+    }
+  }
+};
+
+Buffer* threadBuffer() {
+  // Trivially destructible, so still usable while other thread locals are
+  // destroyed.
+  thread_local Buffer* buffer = nullptr;
+  if (!buffer) {
+    Registry* instance = registry();
+    std::lock_guard<std::mutex> lock(instance->mutex);
+    instance->buffers.emplace_back(new Buffer(instance->nextIndex++));
+    buffer = instance->buffers.back().get();
+    thread_local Retirer retirer;
+    retirer.buffer = buffer;
+  }
+  return buffer;
+}
+
+}  // namespace
+
+Buffer::Buffer(std::uint64_t index)
+    : head_(0)
+    , nextFlow_(0)
+    , index(index)
+    , retired(false) {
+}
+void Buffer::append(const Event& event) {
+  if (!events_) {
+    events_.reset(new Event[Tracer::kEventsPerThread]);
+  }
+  const std::uint64_t head = head_.load(std::memory_order_relaxed);
+  events_[head % Tracer::kEventsPerThread] = event;
+  head_.store(head + 1, std::memory_order_release);
+}
+std::uint64_t Buffer::nextFlow() {
+  return (index << kFlowIndexShift) | ++nextFlow_;
+}
+std::uint64_t Buffer::head() const {
+  return head_.load(std::memory_order_acquire);
+}
+const Event& Buffer::at(std::uint64_t position) const {
+  return events_[position % Tracer::kEventsPerThread];
+}
+void Buffer::clear() {
+  head_.store(0, std::memory_order_relaxed);
+}
+
+void record(TraceEventType type, const void* looper, const void* handler,
+    unsigned int id, std::uint8_t flags, std::uint64_t flow) {
+  const std::int64_t timestamp = std::chrono::duration_cast<
+      std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+  threadBuffer()->append(
+      Event{timestamp, flow, looper, handler, id, type, flags});
+}
+std::uint64_t nextFlow() {
+  return threadBuffer()->nextFlow();
+}
+
+}  // namespace Trace
+
+}  // namespace detail
+
+namespace {
+
+void writeString(std::ostream& os, const std::string& value) {
+  os << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x",
+          static_cast<unsigned int>(c));
+      os << escaped;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+// Microseconds, as the format expects, keeping nanosecond precision.
+void writeTimestamp(std::ostream& os, std::int64_t nanoseconds) {
+  char timestamp[32];
+  std::snprintf(timestamp, sizeof(timestamp), "%lld.%03lld",
+      static_cast<long long>(nanoseconds / 1000),
+      static_cast<long long>(nanoseconds % 1000));
+  os << timestamp;
+}
+
+std::string pointerString(const void* pointer) {
+  char value[32];
+  std::snprintf(value, sizeof(value), "%p", pointer);
+  return value;
+}
+
+std::string sliceName(const detail::Trace::Event& event) {
+  if (event.flags & detail::Trace::kCallback) {
+    return "callback";
+  }
+  return "message " + std::to_string(event.id);
+}
+
+}  // namespace
+
+bool Tracer::start() {
+  detail::Trace::tracing.store(true, std::memory_order_relaxed);
+  return true;
+}
+void Tracer::stop() {
+  detail::Trace::tracing.store(false, std::memory_order_relaxed);
+}
+bool Tracer::isTracing() {
+  return detail::Trace::tracing.load(std::memory_order_relaxed);
+}
+void Tracer::setThreadName(const std::string& name) {
+  detail::Trace::Buffer* buffer = detail::Trace::threadBuffer();
+  std::lock_guard<std::mutex> lock(detail::Trace::registry()->mutex);
+  buffer->name = name;
+}
+void Tracer::clear() {
+  detail::Trace::Registry* registry = detail::Trace::registry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  auto& buffers = registry->buffers;
+  buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+      [](const std::unique_ptr<detail::Trace::Buffer>& buffer) {
+        return buffer->retired.load(std::memory_order_relaxed);
+      }), buffers.end());
+  for (auto& buffer : buffers) {
+    buffer->clear();
+  }
+}
+void Tracer::writeChromeTrace(std::ostream& os) {
+  using detail::Trace::Buffer;
+  using detail::Trace::Event;
+  detail::Trace::Registry* registry = detail::Trace::registry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  // a looper is named after the thread that dispatches its messages
+  std::unordered_map<const void*, const std::string*> looperNames;
+  for (const auto& buffer : registry->buffers) {
+    const std::uint64_t head = buffer->head();
+    for (std::uint64_t i = head - std::min<std::uint64_t>(head,
+        kEventsPerThread); i < head; ++i) {
+      if (buffer->at(i).type == TraceEventType::kDispatchBegin) {
+        looperNames.emplace(buffer->at(i).looper, &buffer->name);
+      }
+    }
+  }
+  const auto looperName = [&looperNames](const void* looper) {
+    auto it = looperNames.find(looper);
+    if (it != looperNames.end() && !it->second->empty()) {
+      return *it->second;
+    }
+    return pointerString(looper);
+  };
+
+  os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  // Writes the fields every event has, leaving the object open.
+  const auto begin = [&os, &first](const char* phase, const std::string& name,
+      std::uint64_t tid, std::int64_t timestamp) {
+    os << (first ? "\n" : ",\n") << "{\"ph\":\"" << phase << "\",\"name\":";
+    first = false;
+    writeString(os, name);
+    os << ",\"cat\":\"looper\",\"pid\":1,\"tid\":" << tid << ",\"ts\":";
+    writeTimestamp(os, timestamp);
+  };
+  for (const auto& buffer : registry->buffers) {
+    const std::uint64_t tid = buffer->index;
+    if (!buffer->name.empty()) {
+      os << (first ? "\n" : ",\n")
+          << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+          << tid << ",\"args\":{\"name\":";
+      first = false;
+      writeString(os, buffer->name);
+      os << "}}";
+    }
+    const std::uint64_t head = buffer->head();
+    for (std::uint64_t i = head - std::min<std::uint64_t>(head,
+        kEventsPerThread); i < head; ++i) {
+      const Event& event = buffer->at(i);
+      const std::string handler = pointerString(event.handler);
+      switch (event.type) {
+        case TraceEventType::kSend:
+          begin("X", "send " + sliceName(event), tid, event.timestamp);
+          os << ",\"dur\":0,\"args\":{\"to\":";
+          writeString(os, looperName(event.looper));
+          os << ",\"handler\":\"" << handler << "\",\"id\":" << event.id
+              << "}}";
+          begin("s", "message", tid, event.timestamp);
+          os << ",\"id\":" << event.flow << "}";
+          break;
+        case TraceEventType::kDispatchBegin:
+          begin("B", sliceName(event), tid, event.timestamp);
+          os << ",\"args\":{\"handler\":\"" << handler << "\",\"id\":"
+              << event.id << "}}";
+          if (event.flow) {
+            begin("f", "message", tid, event.timestamp);
+            os << ",\"bp\":\"e\",\"id\":" << event.flow << "}";
+          }
+          break;
+        case TraceEventType::kDispatchEnd:
+          begin("E", sliceName(event), tid, event.timestamp);
+          os << "}";
+          break;
+        case TraceEventType::kRemove:
+          begin("i", event.flags & detail::Trace::kAllMessages
+              ? std::string("remove all")
+              : "remove " + sliceName(event), tid, event.timestamp);
+          os << ",\"s\":\"t\",\"args\":{\"from\":";
+          writeString(os, looperName(event.looper));
+          os << ",\"handler\":\"" << handler << "\",\"id\":" << event.id
+              << "}}";
+          break;
+      }
+    }
+  }
+  os << "\n]}\n";
+}
+
+#else  // NX_LOOPER_TRACING
+
+bool Tracer::start() {
+  return false;
+}
+void Tracer::stop() {
+}
+bool Tracer::isTracing() {
+  return false;
+}
+void Tracer::setThreadName(const std::string& name) {
+}
+void Tracer::clear() {
+}
+void Tracer::writeChromeTrace(std::ostream& os) {
+  os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}\n";
+}
+
+#endif  // NX_LOOPER_TRACING
+
+}  // namespace nx
@@ -0,0 +1,181 @@
+//
+// Copyright (C) 2014 Jacob McIntosh <nacitar at ubercpp dot com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+/// @file watchdog.cc
+/// @brief Implementation for watchdog.h
+
+#include "nx/watchdog.h"
+
+#include <algorithm>
+#include <utility>
+
+/// @brief Library namespace.
+namespace nx {
+
+namespace {
+
+// Nothing is dispatched with this sequence, as it is odd.
+const std::uint64_t kNoneFlagged = 1;
+
+void writeIncident(std::ostream& os, const SlowDispatch& incident) {
+  os << "'" << incident.looperName << "': ";
+  if (incident.isCallback) {
+    os << "callback";
+  } else {
+    os << "message " << incident.messageId;
+  }
+  os << " to handler " << static_cast<const void*>(incident.handler)
+      << " ran for "
+      << std::chrono::duration<double, std::milli>(incident.elapsed).count()
+      << "ms\n";
+}
+
+}  // namespace
+
+void Watchdog::threadFunction() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!conditionVariable_.wait_for(lock, interval_,
+      [this] { return isStopping_; })) {
+    std::vector<SlowDispatch> flagged;
+    for (Watched& watched : watched_) {
+      SlowDispatch incident;
+      if (check(&watched, &incident)) {
+        if (incidents_.size() == kMaxIncidents) {
+          incidents_.pop_front();
+        }
+        incidents_.push_back(incident);
+        ++incidentCount_;
+        flagged.push_back(std::move(incident));
+      }
+    }
+    // drop loopers that have since been destroyed
+    watched_.erase(std::remove_if(watched_.begin(), watched_.end(),
+        [](const Watched& watched) { return watched.looper.expired(); }),
+        watched_.end());
+    if (!flagged.empty() && callback_) {
+      Callback callback = callback_;
+      lock.unlock();
+      for (const SlowDispatch& incident : flagged) {
+        callback(incident);
+      }
+      lock.lock();
+    }
+  }
+}
+bool Watchdog::check(Watched* watched, SlowDispatch* incident) {
+  // keeps the beacon alive while it is read
+  std::shared_ptr<Looper> looper = watched->looper.lock();
+  if (!looper) {
+    return false;
+  }
+  detail::Looper::DispatchBeacon::Dispatch dispatch;
+  if (!looper->beacon_.read(&dispatch)
+      || dispatch.sequence == watched->flagged) {
+    return false;
+  }
+  const std::chrono::nanoseconds elapsed =
+      std::chrono::steady_clock::now() - dispatch.start;
+  if (elapsed <= budget_) {
+    return false;
+  }
+  watched->flagged = dispatch.sequence;
+  incident->looperName = watched->name;
+  incident->handler = dispatch.handler;
+  incident->messageId = dispatch.isCallback ? 0 : dispatch.id;
+  incident->isCallback = dispatch.isCallback;
+  incident->elapsed = elapsed;
+  return true;
+}
+
+Watchdog::Watchdog(std::chrono::nanoseconds budget,
+    std::chrono::nanoseconds interval)
+    : budget_(budget)
+    , interval_(interval > std::chrono::nanoseconds::zero()
+        ? interval : std::max(budget / 4, std::chrono::nanoseconds(1)))
+    , isStopping_(false)
+    , incidentCount_(0) {
+  thread_ = std::thread(&Watchdog::threadFunction, this);
+}
+Watchdog::~Watchdog() {
+  { // arbitrary block
+    std::lock_guard<std::mutex> lock(mutex_);
+    isStopping_ = true;
+    conditionVariable_.notify_all();
+  }
+  thread_.join();
+  for (Watched& watched : watched_) {
+    if (std::shared_ptr<Looper> looper = watched.looper.lock()) {
+      looper->watchers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+void Watchdog::watch(Looper* looper, const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const Watched& watched : watched_) {
+    if (watched.key == looper && !watched.looper.expired()) {
+      return;
+    }
+  }
+  looper->watchers_.fetch_add(1, std::memory_order_relaxed);
+  watched_.push_back(
+      Watched{looper->shared_from_this(), looper, name, kNoneFlagged});
+}
+void Watchdog::watch(HandlerThread* thread) {
+  watch(thread->getLooper(), thread->getName());
+}
+void Watchdog::unwatch(Looper* looper) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = watched_.begin(); it != watched_.end(); ++it) {
+    if (it->key != looper) {
+      continue;
+    }
+    if (std::shared_ptr<Looper> watchedLooper = it->looper.lock()) {
+      watchedLooper->watchers_.fetch_sub(1, std::memory_order_relaxed);
+      watched_.erase(it);
+      return;
+    }
+  }
+}
+
+void Watchdog::setCallback(Callback callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  callback_ = std::move(callback);
+}
+std::vector<SlowDispatch> Watchdog::incidents() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::vector<SlowDispatch>(incidents_.begin(), incidents_.end());
+}
+std::uint64_t Watchdog::incidentCount() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return incidentCount_;
+}
+void Watchdog::dumpReport(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  os << "watchdog: budget "
+      << std::chrono::duration<double, std::milli>(budget_).count()
+      << "ms, " << incidentCount_ << " incident(s)\n";
+  for (const Watched& watched : watched_) {
+    if (!watched.looper.expired()) {
+      os << "watching '" << watched.name << "'\n";
+    }
+  }
+  for (const SlowDispatch& incident : incidents_) {
+    writeIncident(os, incident);
+  }
+}
+
+}  // namespace nx